@@ -0,0 +1,306 @@
+#include "Base64.h"
+
+#include <cstring>     // for memcpy()
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>     // for __get_cpuid()
+#include <immintrin.h> // for SSE and AVX2 intrinsics
+#endif
+
+using std::string;
+using std::vector;
+
+size_t base64EncodedLength(size_t length) {
+    return (length + 2) / 3 * 4;
+}
+
+size_t base64DecodedMaxLength(size_t length) {
+    return length / 4 * 3;
+}
+
+/*
+ * Scalar code, used on its own when the CPU has no vector kernel and by the vector kernels for whatever is left over.
+ * base64 uses an 8-bit character to store 6 "raw" bits. These sync up at the least common multiple, 24 bits (every 3
+ * bytes of input).
+ */
+size_t encodeScalar(const uint8_t *input, size_t length, char *output) {
+    char *out = output;
+    size_t i = 0;
+    for (; i + 2 < length; i += 3) {
+        uint32_t group = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        *out++ = BASE64_CHARS[(group >> 18) & 0x3F];
+        *out++ = BASE64_CHARS[(group >> 12) & 0x3F];
+        *out++ = BASE64_CHARS[(group >> 6) & 0x3F];
+        *out++ = BASE64_CHARS[group & 0x3F];
+    }
+
+    // Get the remaining 1 or 2 bytes
+    switch (length - i) {
+        case 1:
+            *out++ = BASE64_CHARS[input[i] >> 2];
+            *out++ = BASE64_CHARS[(input[i] & 0x03) << 4];
+            *out++ = BASE64_PAD_CHAR;
+            *out++ = BASE64_PAD_CHAR;
+            break;
+        case 2:
+            *out++ = BASE64_CHARS[input[i] >> 2];
+            *out++ = BASE64_CHARS[((input[i] & 0x03) << 4) | (input[i + 1] >> 4)];
+            *out++ = BASE64_CHARS[(input[i + 1] & 0x0F) << 2];
+            *out++ = BASE64_PAD_CHAR;
+            break;
+        default:
+            break;
+    }
+    return out - output;
+}
+
+// Decode whole groups of four characters. Returns how many bytes were written.
+size_t decodeScalar(const char *input, size_t length, uint8_t *output) {
+    uint8_t *out = output;
+    for (size_t i = 0; i + 3 < length; i += 4) {
+        uint32_t group = (BASE64_REVERSE_MAP[static_cast<uint8_t>(input[i])] << 18) |
+                         (BASE64_REVERSE_MAP[static_cast<uint8_t>(input[i + 1])] << 12) |
+                         (BASE64_REVERSE_MAP[static_cast<uint8_t>(input[i + 2])] << 6) |
+                         BASE64_REVERSE_MAP[static_cast<uint8_t>(input[i + 3])];
+
+        *out++ = static_cast<uint8_t>(group >> 16);
+        if (input[i + 2] != BASE64_PAD_CHAR) {
+            *out++ = static_cast<uint8_t>(group >> 8);
+        }
+        if (input[i + 3] != BASE64_PAD_CHAR) {
+            *out++ = static_cast<uint8_t>(group);
+        }
+    }
+    return out - output;
+}
+
+/*
+ * The vector kernels follow Wojciech Muła and Daniel Lemire, "Faster Base64 Encoding and Decoding Using AVX2
+ * Instructions" (https://arxiv.org/abs/1704.00605). Each kernel handles as many whole blocks as it can without
+ * reading or writing past the ends of the buffers, and leaves the rest to the scalar code.
+ *
+ * Encoding: every 3 input bytes are spread over a 32 bit lane, the four 6 bit fields are moved into their own bytes
+ * with two multiplies, and each field is turned into its character by adding an offset looked up from its range.
+ *
+ * Decoding: each character's high and low nibbles index two tables of bit flags which only share a set bit for
+ * characters outside the alphabet, so a whole block is validated at once. A block with anything else in it,
+ * including padding, is decoded by the scalar code so that the output is exactly the same.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+inline __m128i encodeLookup128(__m128i indices) {
+    const __m128i shiftLUT = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                           '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+    __m128i result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+    return _mm_add_epi8(_mm_shuffle_epi8(shiftLUT, result), indices);
+}
+
+__attribute__((target("ssse3")))
+size_t encodeSSSE3(const uint8_t *input, size_t length, char *output) {
+    const __m128i spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    size_t i = 0;
+    // 16 bytes are loaded but only 12 are used
+    for (; i + 16 <= length; i += 12) {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i)), spread);
+        __m128i high = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        __m128i low = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output + i / 3 * 4), encodeLookup128(_mm_or_si128(high, low)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t encodeAVX2(const uint8_t *input, size_t length, char *output) {
+    const __m256i spread = _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                           10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m256i shiftLUT = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                              '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                              'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                              '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    size_t i = 0;
+    // Each 128 bit half takes 12 bytes; the second half's load reaches 4 bytes past the 24 that are used
+    for (; i + 28 <= length; i += 24) {
+        __m256i in = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, spread);
+        __m256i high = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)),
+                                          _mm256_set1_epi32(0x04000040));
+        __m256i low = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)),
+                                         _mm256_set1_epi32(0x01000010));
+        __m256i indices = _mm256_or_si256(high, low);
+
+        __m256i result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        result = _mm256_or_si256(result, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+        result = _mm256_add_epi8(_mm256_shuffle_epi8(shiftLUT, result), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output + i / 3 * 4), result);
+    }
+    return i + encodeSSSE3(input + i, length - i, output + i / 3 * 4);
+}
+
+// Returns false if the block has any character outside the alphabet, otherwise turns the characters into 6 bit values
+__attribute__((target("ssse3,sse4.1")))
+inline bool decodeLookup128(__m128i &block) {
+    const __m128i lutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2F);
+
+    __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(block, 4), mask2F);
+    __m128i loNibbles = _mm_and_si128(block, mask2F);
+    if (!_mm_testz_si128(_mm_shuffle_epi8(lutLo, loNibbles), _mm_shuffle_epi8(lutHi, hiNibbles))) {
+        return false;
+    }
+    // '/' shares its high nibble with '+', so it's moved to its own entry
+    __m128i roll = _mm_shuffle_epi8(lutRoll, _mm_add_epi8(_mm_cmpeq_epi8(block, mask2F), hiNibbles));
+    block = _mm_add_epi8(block, roll);
+    return true;
+}
+
+// Pack four 6 bit values per lane into three bytes, leaving 12 bytes at the start of the register
+__attribute__((target("ssse3")))
+inline __m128i decodePack128(__m128i values) {
+    __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3,sse4.1")))
+size_t decodeSSE41(const char *input, size_t length, uint8_t *output, size_t &written) {
+    uint8_t *out = output;
+    size_t i = 0;
+    // Each block writes 16 bytes for 12 bytes of output, so stop while at least 4 groups (and 4 bytes) are still to come
+    for (; i + 32 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input + i));
+        if (decodeLookup128(block)) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out), decodePack128(block));
+            out += 12;
+        } else {
+            out += decodeScalar(input + i, 16, out);
+        }
+    }
+    written = out - output;
+    return i;
+}
+
+__attribute__((target("avx2")))
+size_t decodeAVX2(const char *input, size_t length, uint8_t *output, size_t &written) {
+    const __m256i lutLo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                           0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                           0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lutHi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                           0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lutRoll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                             0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask2F = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    uint8_t *out = output;
+    size_t i = 0;
+    // Each block writes 32 bytes for 24 bytes of output, so stop while at least 8 groups are still to come
+    for (; i + 64 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input + i));
+        __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(block, 4), mask2F);
+        __m256i loNibbles = _mm256_and_si256(block, mask2F);
+        if (!_mm256_testz_si256(_mm256_shuffle_epi8(lutLo, loNibbles), _mm256_shuffle_epi8(lutHi, hiNibbles))) {
+            out += decodeScalar(input + i, 32, out);
+            continue;
+        }
+        __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(block, mask2F), hiNibbles));
+        block = _mm256_add_epi8(block, roll);
+
+        __m256i merged = _mm256_maddubs_epi16(block, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_shuffle_epi8(merged, pack);
+        // Close the gap between the 12 bytes in each half
+        merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), merged);
+        out += 24;
+    }
+
+    size_t tailWritten;
+    size_t consumed = decodeSSE41(input + i, length - i, out, tailWritten);
+    written = (out - output) + tailWritten;
+    return i + consumed;
+}
+#endif
+
+size_t encodeNone(const uint8_t *, size_t, char *) {
+    return 0;
+}
+
+size_t decodeNone(const char *, size_t, uint8_t *, size_t &written) {
+    written = 0;
+    return 0;
+}
+
+// Kernels handle the bulk of the input and return how much of it they used; the scalar code does the rest
+typedef size_t (*EncodeKernel)(const uint8_t *, size_t, char *);
+
+typedef size_t (*DecodeKernel)(const char *, size_t, uint8_t *, size_t &);
+
+struct Base64Kernels {
+    EncodeKernel encode;
+    DecodeKernel decode;
+};
+
+// Pick the fastest kernels this CPU supports
+Base64Kernels selectKernels() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)) {
+        // AVX2 also needs the OS to save the upper halves of the registers, which XGETBV reports
+        bool osSavesYMM = false;
+        if (ecx & bit_OSXSAVE) {
+            unsigned int xcr0Lo, xcr0Hi;
+            __asm__("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+            osSavesYMM = (xcr0Lo & 0x6) == 0x6;
+        }
+        if (osSavesYMM && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2)) {
+            return Base64Kernels{encodeAVX2, decodeAVX2};
+        }
+        return Base64Kernels{encodeSSSE3, decodeSSE41};
+    }
+#endif
+    return Base64Kernels{encodeNone, decodeNone};
+}
+
+const Base64Kernels &base64Kernels() {
+    static const Base64Kernels kernels = selectKernels();
+    return kernels;
+}
+
+size_t base64Encode(const char *input, size_t length, char *output) {
+    auto in = reinterpret_cast<const uint8_t *>(input);
+    size_t consumed = base64Kernels().encode(in, length, output);
+    size_t written = consumed / 3 * 4;
+    return written + encodeScalar(in + consumed, length - consumed, output + written);
+}
+
+size_t base64Decode(const char *input, size_t length, char *output) {
+    auto out = reinterpret_cast<uint8_t *>(output);
+    size_t written;
+    size_t consumed = base64Kernels().decode(input, length, out, written);
+    return written + decodeScalar(input + consumed, length - consumed, out + written);
+}
+
+string base64Encode(const std::vector<char> &inputBuffer) {
+    string output(base64EncodedLength(inputBuffer.size()), '\0');
+    base64Encode(inputBuffer.data(), inputBuffer.size(), &output[0]);
+    return output;
+}
+
+string base64Decode(const string &inputString) {
+    string output(base64DecodedMaxLength(inputString.size()), '\0');
+    output.resize(base64Decode(inputString.data(), inputString.size(), &output[0]));
+    return output;
+}
@@ -0,0 +1,47 @@
+#ifndef PROJECT4_BASE64_H
+#define PROJECT4_BASE64_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+const std::string BASE64_CHARS = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const char BASE64_PAD_CHAR = '=';
+const uint8_t BASE64_REVERSE_MAP[256] = { // 16x16 unsigned chars. Base64 ASCII subset
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 62, 0, 0, 0, 63,
+        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 0, 0, 0, 0, 0, 0,
+        0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0, 0,
+        0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+size_t base64EncodedLength(size_t length);
+
+// Encode length bytes into output, which needs room for base64EncodedLength(length) characters. Returns that length.
+size_t base64Encode(const char *input, size_t length, char *output);
+
+size_t base64DecodedMaxLength(size_t length);
+
+/*
+ * Decode length characters into output, which needs room for base64DecodedMaxLength(length) bytes. Returns how many
+ * bytes were written. Characters outside the alphabet decode as zero bits and a trailing partial group is ignored.
+ */
+size_t base64Decode(const char *input, size_t length, char *output);
+
+std::string base64Encode(const std::vector<char> &inputBuffer);
+
+std::string base64Decode(const std::string &inputString);
+
+#endif
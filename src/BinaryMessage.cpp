@@ -0,0 +1,376 @@
+#include "BinaryMessage.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <arpa/inet.h>
+
+using std::string;
+
+/*
+ * The type code is in the frame header. The body is the version, one byte, then from version 5 the message's request
+ * ID as a 4-byte integer (0 if it has none), followed by whatever that type carries:
+ *
+ *   listRequest, leave:                  nothing
+ *   listResponse:                        maxVersion (1 byte), then file entries
+ *   pull/push/manifest requests and responses:    file entries
+ *   listSinceRequest:                    journal ID (2-byte length and the ID), then the generation (8 bytes)
+ *
+ * From version 7 a listRequest carries the most files to send (4 bytes, 0 for all of them) and the filename to list
+ * from (2-byte length and the name, empty for the start), and a listResponse has the filename the next page starts
+ * after (empty on the last page) between maxVersion and its file entries. From version 8 that is followed by the
+ * listing's journal ID (2-byte length and the ID, empty if it has none) and generation (8 bytes), then a byte that is
+ * 1 if the response only holds what changed and 0 if it's a listing, and if it's 1, the generation the changes are
+ * since (8 bytes) and the filenames removed since (4-byte count, then a 2-byte length and the name for each).
+ *
+ * File entries are a 4-byte count, then for each file a 2-byte filename length, the filename, and the CRC as a
+ * 4-byte integer. From version 4 each entry then has a flags byte, followed by the entry's base filename (2-byte
+ * length and the name) if FLAG_BASE is set, and its chunks (4-byte count, then an 8-byte hash and 4-byte length for
+ * each) if FLAG_CHUNKS is set. Every integer is big-endian.
+ */
+struct MessageType {
+    uint8_t code;
+    const char *name;
+    const char *listKey;  // the key holding the file entries, if there are any
+};
+
+const MessageType MESSAGE_TYPES[] = {
+        {1, "listRequest",  nullptr},
+        {2, "listResponse", "response"},
+        {3, "pullRequest",  "request"},
+        {4, "pullResponse", "response"},
+        {5, "pushRequest",  "request"},
+        {6, "pushResponse", "response"},
+        {7, "leave",        nullptr},
+        {8, "manifestRequest",  "request"},
+        {9, "manifestResponse", "response"},
+        {10, "listSinceRequest", nullptr},
+};
+
+const uint8_t FLAG_BASE = 1;
+const uint8_t FLAG_CHUNKS = 2;
+
+static void appendUint16(string &out, uint16_t value) {
+    value = htons(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void appendUint32(string &out, uint32_t value) {
+    value = htonl(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void appendUint64(string &out, uint64_t value) {
+    appendUint32(out, static_cast<uint32_t>(value >> 32));
+    appendUint32(out, static_cast<uint32_t>(value));
+}
+
+static void appendString(string &out, const string &value) {
+    if (value.size() > UINT16_MAX) {
+        throw std::invalid_argument("Filename too long to encode: " + value);
+    }
+    appendUint16(out, static_cast<uint16_t>(value.size()));
+    out += value;
+}
+
+// Checksums are lowercase hex strings everywhere else, as CRC32State::toString() writes them
+static uint32_t checksumToInt(const string &checksum) {
+    return static_cast<uint32_t>(strtoul(checksum.c_str(), nullptr, 16));
+}
+
+static string checksumToString(uint32_t checksum) {
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%x", checksum);
+    return string(hex);
+}
+
+// Chunk hashes don't fit in a double, so they're 16 hex digits
+static uint64_t chunkHashToInt(const string &hash) {
+    return static_cast<uint64_t>(strtoull(hash.c_str(), nullptr, 16));
+}
+
+static string chunkHashToString(uint64_t hash) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+    return string(hex);
+}
+
+JSON chunksToJSON(const std::vector<Chunk> &chunks) {
+    JSON list;
+    list.makeArray();
+    for (const auto &chunk : chunks) {
+        JSON entry;
+        entry["hash"] = JSON(chunkHashToString(chunk.hash), true);
+        entry["length"] = static_cast<double>(chunk.length);
+        list.push(std::move(entry));
+    }
+    return list;
+}
+
+std::vector<Chunk> chunksFromJSON(const JSON &list) {
+    std::vector<Chunk> chunks;
+    chunks.reserve(list.getLength());
+    for (const auto &entry : list) {
+        chunks.push_back(Chunk{chunkHashToInt(entry["hash"].getString()),
+                               static_cast<uint32_t>(entry["length"].getNumber())});
+    }
+    return chunks;
+}
+
+void encodeFrameHeader(const FrameHeader &header, char *out) {
+    out[0] = static_cast<char>(FRAME_MARKER);
+    out[1] = static_cast<char>(header.type);
+    uint32_t length = htonl(header.length);
+    memcpy(out + 2, &length, sizeof(length));
+}
+
+// Read the header from the FRAME_HEADER_LENGTH bytes at data. Returns false if they aren't one.
+bool decodeFrameHeader(const char *data, FrameHeader &header) {
+    if (static_cast<unsigned char>(data[0]) != FRAME_MARKER) {
+        return false;
+    }
+    header.type = static_cast<uint8_t>(data[1]);
+    uint32_t length;
+    memcpy(&length, data + 2, sizeof(length));
+    header.length = ntohl(length);
+    return true;
+}
+
+string encodeBinaryMessage(const JSON &message) {
+    string type = message["type"].getString();
+    const MessageType *messageType = nullptr;
+    for (const auto &t : MESSAGE_TYPES) {
+        if (type == t.name) {
+            messageType = &t;
+        }
+    }
+    if (messageType == nullptr) {
+        throw std::invalid_argument("Cannot encode message of type " + type);
+    }
+
+    string out(FRAME_HEADER_LENGTH, '\0');  // filled in once the body's length is known
+    out += static_cast<char>(message["version"].getNumber());
+    if (message["version"].getNumber() >= PIPELINE_VERSION) {
+        appendUint32(out, message.hasKey("id") ? static_cast<uint32_t>(message["id"].getNumber()) : 0);
+    }
+    bool paged = message["version"].getNumber() >= PAGED_LIST_VERSION;
+    if (messageType->code == 1 && paged) {
+        appendUint32(out, message.hasKey("limit") ? static_cast<uint32_t>(message["limit"].getNumber()) : 0);
+        appendString(out, message.hasKey("after") ? message["after"].getString() : string());
+    }
+    if (messageType->code == 2) {
+        double maxVersion = message.hasKey("maxVersion") ? message["maxVersion"].getNumber()
+                                                         : message["version"].getNumber();
+        out += static_cast<char>(maxVersion);
+        if (paged) {
+            appendString(out, message.hasKey("next") ? message["next"].getString() : string());
+        }
+        if (message["version"].getNumber() >= LIST_SINCE_VERSION) {
+            bool journalled = message.hasKey("journal");
+            appendString(out, journalled ? message["journal"].getString() : string());
+            appendUint64(out, journalled ? static_cast<uint64_t>(message["generation"].getNumber()) : 0);
+            out += static_cast<char>(message.hasKey("since") ? 1 : 0);
+            if (message.hasKey("since")) {
+                appendUint64(out, static_cast<uint64_t>(message["since"].getNumber()));
+                const JSON &removed = message["removed"];
+                appendUint32(out, static_cast<uint32_t>(removed.getLength()));
+                for (const auto &filename : removed) {
+                    appendString(out, filename.getString());
+                }
+            }
+        }
+    }
+    if (messageType->code == 10) {
+        appendString(out, message["journal"].getString());
+        appendUint64(out, static_cast<uint64_t>(message["generation"].getNumber()));
+    }
+    if (messageType->listKey != nullptr) {
+        const JSON &files = message[messageType->listKey];
+        appendUint32(out, static_cast<uint32_t>(files.getLength()));
+        bool withExtras = message["version"].getNumber() >= DELTA_VERSION;
+        for (const auto &file : files) {
+            appendString(out, file["filename"].getString());
+            appendUint32(out, checksumToInt(file["checksum"].getString()));
+            if (withExtras) {
+                uint8_t flags = (file.hasKey("base") ? FLAG_BASE : 0) | (file.hasKey("chunks") ? FLAG_CHUNKS : 0);
+                out += static_cast<char>(flags);
+                if (flags & FLAG_BASE) {
+                    appendString(out, file["base"].getString());
+                }
+                if (flags & FLAG_CHUNKS) {
+                    const JSON &chunks = file["chunks"];
+                    appendUint32(out, static_cast<uint32_t>(chunks.getLength()));
+                    for (const auto &chunk : chunks) {
+                        appendUint64(out, chunkHashToInt(chunk["hash"].getString()));
+                        appendUint32(out, static_cast<uint32_t>(chunk["length"].getNumber()));
+                    }
+                }
+            }
+        }
+    }
+
+    FrameHeader header{messageType->code, static_cast<uint32_t>(out.size() - FRAME_HEADER_LENGTH)};
+    encodeFrameHeader(header, &out[0]);
+    return out;
+}
+
+// Reads integers and strings out of a body, throwing if it ends too soon
+class BodyReader {
+public:
+    BodyReader(const char *body, size_t length) : pos(body), end(body + length) {}
+
+    uint8_t readUint8() {
+        this->need(1);
+        return static_cast<uint8_t>(*this->pos++);
+    }
+
+    uint16_t readUint16() {
+        uint16_t value;
+        this->read(&value, sizeof(value));
+        return ntohs(value);
+    }
+
+    uint32_t readUint32() {
+        uint32_t value;
+        this->read(&value, sizeof(value));
+        return ntohl(value);
+    }
+
+    uint64_t readUint64() {
+        uint64_t high = this->readUint32();
+        return (high << 32) | this->readUint32();
+    }
+
+    string readString(size_t length) {
+        this->need(length);
+        string value(this->pos, length);
+        this->pos += length;
+        return value;
+    }
+
+    size_t remaining() const { return this->end - this->pos; }
+
+private:
+    void need(size_t length) const {
+        if (this->remaining() < length) {
+            throw std::invalid_argument("Binary message is truncated");
+        }
+    }
+
+    void read(void *dest, size_t length) {
+        this->need(length);
+        memcpy(dest, this->pos, length);
+        this->pos += length;
+    }
+
+    const char *pos;
+    const char *end;
+};
+
+JSON decodeBinaryMessage(const FrameHeader &header, const char *body) {
+    BodyReader reader(body, header.length);
+    uint8_t code = header.type;
+    double version = reader.readUint8();
+    const MessageType *messageType = nullptr;
+    for (const auto &t : MESSAGE_TYPES) {
+        if (code == t.code) {
+            messageType = &t;
+        }
+    }
+    if (messageType == nullptr) {
+        throw std::invalid_argument("Unknown binary message type");
+    }
+
+    JSON message;
+    message["version"] = version;
+    message["type"] = JSON(messageType->name, true);
+    if (version >= PIPELINE_VERSION) {
+        uint32_t id = reader.readUint32();
+        if (id != 0) {
+            message["id"] = static_cast<double>(id);
+        }
+    }
+    if (code == 1 && version >= PAGED_LIST_VERSION) {
+        uint32_t limit = reader.readUint32();
+        string after = reader.readString(reader.readUint16());
+        if (limit != 0) {
+            message["limit"] = static_cast<double>(limit);
+        }
+        if (!after.empty()) {
+            message["after"] = JSON(after, true);
+        }
+    }
+    if (code == 2) {
+        message["maxVersion"] = static_cast<double>(reader.readUint8());
+        if (version >= PAGED_LIST_VERSION) {
+            string next = reader.readString(reader.readUint16());
+            if (!next.empty()) {
+                message["next"] = JSON(next, true);
+            }
+        }
+        if (version >= LIST_SINCE_VERSION) {
+            string journal = reader.readString(reader.readUint16());
+            double generation = static_cast<double>(reader.readUint64());
+            if (!journal.empty()) {
+                message["journal"] = JSON(journal, true);
+                message["generation"] = generation;
+            }
+            if (reader.readUint8() == 1) {
+                message["since"] = static_cast<double>(reader.readUint64());
+                uint32_t count = reader.readUint32();
+                // Every name takes at least 2 bytes
+                if (count > reader.remaining() / 2) {
+                    throw std::invalid_argument("Binary message is truncated");
+                }
+                JSON removed;
+                removed.makeArray();
+                for (uint32_t i = 0; i < count; i++) {
+                    removed.push(JSON(reader.readString(reader.readUint16()), true));
+                }
+                message["removed"] = std::move(removed);
+            }
+        }
+    }
+    if (code == 10) {
+        message["journal"] = JSON(reader.readString(reader.readUint16()), true);
+        message["generation"] = static_cast<double>(reader.readUint64());
+    }
+    if (messageType->listKey != nullptr) {
+        uint32_t count = reader.readUint32();
+        // Every entry takes at least 6 bytes, so a bogus count can't make us allocate much
+        if (count > reader.remaining() / 6) {
+            throw std::invalid_argument("Binary message is truncated");
+        }
+        bool withExtras = version >= DELTA_VERSION;
+        JSON files;
+        files.makeArray();
+        for (uint32_t i = 0; i < count; i++) {
+            JSON file;
+            file["filename"] = JSON(reader.readString(reader.readUint16()), true);
+            file["checksum"] = JSON(checksumToString(reader.readUint32()), true);
+            uint8_t flags = withExtras ? reader.readUint8() : 0;
+            if (flags & FLAG_BASE) {
+                file["base"] = JSON(reader.readString(reader.readUint16()), true);
+            }
+            if (flags & FLAG_CHUNKS) {
+                uint32_t chunkCount = reader.readUint32();
+                if (chunkCount > reader.remaining() / 12) {
+                    throw std::invalid_argument("Binary message is truncated");
+                }
+                JSON chunks;
+                chunks.makeArray();
+                for (uint32_t c = 0; c < chunkCount; c++) {
+                    JSON chunk;
+                    chunk["hash"] = JSON(chunkHashToString(reader.readUint64()), true);
+                    chunk["length"] = static_cast<double>(reader.readUint32());
+                    chunks.push(std::move(chunk));
+                }
+                file["chunks"] = std::move(chunks);
+            }
+            files.push(std::move(file));
+        }
+        message[messageType->listKey] = std::move(files);
+    }
+    return message;
+}
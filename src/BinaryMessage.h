@@ -0,0 +1,57 @@
+#ifndef BINARY_MESSAGE_H
+#define BINARY_MESSAGE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "HappyPathJSON.h"
+#include "Chunker.h"
+
+// Version 3 sends every message in a compact binary encoding instead of as JSON text
+const double BINARY_VERSION = 3.0;
+// Version 4 adds chunk manifests to file entries, so a file can be sent as a delta against one the receiver has
+const double DELTA_VERSION = 4.0;
+// Version 5 tags each request with an ID that its response repeats, so a client can have many requests in flight
+const double PIPELINE_VERSION = 5.0;
+// Version 6 may send blocks of file bodies compressed, when that makes them smaller; messages are the same as version 5
+const double COMPRESSION_VERSION = 6.0;
+// Version 7 can send a listing a page at a time, each listResponse saying where the next page starts
+const double PAGED_LIST_VERSION = 7.0;
+
+// Version 8 numbers each change to the server's listing, so a client can ask for only what changed since it last looked
+const double LIST_SINCE_VERSION = 8.0;
+
+/*
+ * Binary messages are sent in frames. A frame header is a marker byte, the message type, and the length of the body
+ * as a 4-byte big-endian integer, so a receiver knows what is coming and how big it is before reading any of it. No
+ * JSON message can start with the marker, so framed and newline-terminated messages can share a connection.
+ */
+const unsigned char FRAME_MARKER = 0xB3;
+const size_t FRAME_HEADER_LENGTH = 2 + sizeof(uint32_t);
+
+struct FrameHeader {
+    uint8_t type;
+    uint32_t length;
+};
+
+void encodeFrameHeader(const FrameHeader &header, char *out);
+
+bool decodeFrameHeader(const char *data, FrameHeader &header);
+
+/*
+ * Encode a message, given in the same form as the JSON messages, as a frame. Only the fields that the JSON messages
+ * carry are encoded, and file entries never carry data; file bodies are streamed after the message as in version 2.
+ */
+std::string encodeBinaryMessage(const JSON &message);
+
+// Decode a frame's body into the same form as the JSON messages. Throws std::invalid_argument.
+JSON decodeBinaryMessage(const FrameHeader &header, const char *body);
+
+// A file entry's "chunks": an array of {"hash": 16 hex digits, "length": bytes}
+JSON chunksToJSON(const std::vector<Chunk> &chunks);
+
+std::vector<Chunk> chunksFromJSON(const JSON &list);
+
+#endif
@@ -2,6 +2,23 @@
 #define CRC32_H
 
 #include <string>
+#include <cstddef>
+#include <stdint.h>
+
+// Incremental CRC-32 for data that arrives in pieces: construct, update() with each piece in order, then finalize()
+class CRC32State {
+public:
+    CRC32State();
+
+    void update(const char *data, size_t length);
+
+    uint32_t finalize() const;
+
+    std::string toString() const;
+
+private:
+    uint32_t crc;
+};
 
 std::string computeCRC(const std::string& filepath);
 
@@ -0,0 +1,48 @@
+#include "ChangeJournal.h"
+
+#include <cstdio>
+#include <random>
+
+using std::string;
+using std::set;
+
+ChangeJournal::ChangeJournal() {
+    std::random_device random;
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%08x%08x", random(), random());
+    this->journalId = hex;
+}
+
+const string &ChangeJournal::id() const {
+    return this->journalId;
+}
+
+uint64_t ChangeJournal::generation() const {
+    return this->current;
+}
+
+void ChangeJournal::record(const string &filename) {
+    this->changes.emplace_back(++this->current, filename);
+    if (this->changes.size() > JOURNAL_LENGTH) {
+        this->oldest = this->changes.front().first;
+        this->changes.pop_front();
+    }
+}
+
+/*
+ * The names of the files changed after generation since, each once however often it changed. Returns false if the
+ * journal doesn't go back that far, since is newer than anything it has, or more than limit files changed.
+ */
+bool ChangeJournal::changedSince(uint64_t since, size_t limit, set<string> &filenames) const {
+    if (since < this->oldest || since > this->current) {
+        return false;
+    }
+    // Generations go up by one, so the first change after since is found by counting
+    for (auto it = this->changes.begin() + (since - this->oldest); it != this->changes.end(); ++it) {
+        filenames.insert(it->second);
+        if (filenames.size() > limit) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef CHANGE_JOURNAL_H
+#define CHANGE_JOURNAL_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include <utility>
+#include <stdint.h>
+
+#include "Project4Common.h"
+
+// How many changes a journal remembers; a client that last looked further back than that gets the whole listing
+const size_t JOURNAL_LENGTH = 100000;
+
+/*
+ * Which files in a listing changed, and in what order. Every change is appended with the next generation number, so
+ * a client that remembers the generation it last listed at can ask for only what changed since. Only filenames are
+ * kept: whoever owns the journal says what each file is now, or that it's gone. Each journal has a random ID, so a
+ * generation from before a restart is never mistaken for one from after it. Not thread safe; the owner's lock covers
+ * it.
+ */
+class ChangeJournal {
+public:
+    ChangeJournal();
+
+    const std::string &id() const;
+
+    uint64_t generation() const;
+
+    void record(const std::string &filename);
+
+    bool changedSince(uint64_t since, size_t limit, std::set<std::string> &filenames) const;
+
+private:
+    std::string journalId;
+    uint64_t current = 0;  // the generation of the newest change
+    uint64_t oldest = 0;   // every change after this generation is still remembered
+    std::deque<std::pair<uint64_t, std::string>> changes;
+};
+
+// How a listing changed since a generation: files added or changed, as they are now, and files that are gone
+struct ListingChanges {
+    uint64_t generation;  // the generation these bring the listing up to
+    std::vector<MusicData> changed;
+    std::vector<std::string> removed;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "ChecksumIndex.h"
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+
+using std::string;
+using std::set;
+using std::ifstream;
+using std::stringstream;
+
+#ifdef __APPLE__
+#define MTIME_NSEC(s) ((s).st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(s) ((s).st_mtim.tv_nsec)
+#endif
+
+ChecksumIndex::ChecksumIndex(const string &directory) {
+    this->directory = directory;
+    if (this->directory.back() != '/' && this->directory.back() != '\\') {
+        this->directory += '/';
+    }
+    load();
+}
+
+ChecksumIndex::Entry ChecksumIndex::makeEntry(const struct stat &statStruct, const string &checksum) {
+    Entry e;
+    e.inode = statStruct.st_ino;
+    e.size = statStruct.st_size;
+    e.mtimeSec = statStruct.st_mtime;
+    e.mtimeNsec = MTIME_NSEC(statStruct);
+    e.checksum = checksum;
+    return e;
+}
+
+/*
+ * Each line of the index is "inode size mtimeSec mtimeNsec checksum filename". The filename comes last since it may
+ * contain spaces.
+ */
+void ChecksumIndex::load() {
+    ifstream input(this->directory + CHECKSUM_INDEX_FILENAME);
+    string line;
+    while (std::getline(input, line)) {
+        stringstream lineStream(line);
+        Entry e;
+        string filename;
+        if (!(lineStream >> e.inode >> e.size >> e.mtimeSec >> e.mtimeNsec >> e.checksum)) {
+            continue;
+        }
+        lineStream.get();  // single space separator
+        std::getline(lineStream, filename);
+        if (!filename.empty()) {
+            this->entries[filename] = e;
+        }
+    }
+}
+
+bool ChecksumIndex::lookup(const string &filename, const struct stat &statStruct, string &checksum) const {
+    auto it = this->entries.find(filename);
+    if (it == this->entries.end()) {
+        return false;
+    }
+    const Entry &e = it->second;
+    if (e.inode != statStruct.st_ino || e.size != statStruct.st_size || e.mtimeSec != statStruct.st_mtime
+        || e.mtimeNsec != MTIME_NSEC(statStruct)) {
+        return false;
+    }
+    checksum = e.checksum;
+    return true;
+}
+
+void ChecksumIndex::update(const string &filename, const struct stat &statStruct, const string &checksum) {
+    // A file modified within the last couple of seconds could be written again without its mtime changing, so
+    // don't cache it until it has settled. It'll just be checksummed again next time.
+    if (statStruct.st_mtime >= time(nullptr) - 2 || filename.find('\n') != string::npos) {
+        if (this->entries.erase(filename) > 0) {
+            this->dirty = true;
+        }
+        return;
+    }
+    this->entries[filename] = makeEntry(statStruct, checksum);
+    this->dirty = true;
+}
+
+// Drop entries for files that no longer exist
+void ChecksumIndex::retainOnly(const set<string> &filenames) {
+    for (auto it = this->entries.begin(); it != this->entries.end();) {
+        if (filenames.find(it->first) == filenames.end()) {
+            it = this->entries.erase(it);
+            this->dirty = true;
+        } else {
+            ++it;
+        }
+    }
+}
+
+/*
+ * Write the index to a temporary file and rename it into place, so that a reader never sees a half-written index
+ * and concurrent writers can't interleave
+ */
+bool ChecksumIndex::save() {
+    if (!this->dirty) {
+        return true;
+    }
+
+    string indexPath = this->directory + CHECKSUM_INDEX_FILENAME;
+    string tmpTemplate = indexPath + ".XXXXXX";
+    std::vector<char> tmpPath(tmpTemplate.begin(), tmpTemplate.end());
+    tmpPath.push_back('\0');
+    int fd = mkstemp(tmpPath.data());
+    if (fd < 0) {
+        perror("Could not create checksum index");
+        return false;
+    }
+
+    FILE *output = fdopen(fd, "w");
+    for (const auto &entry : this->entries) {
+        const Entry &e = entry.second;
+        fprintf(output, "%llu %lld %lld %ld %s %s\n", (unsigned long long) e.inode, (long long) e.size,
+                (long long) e.mtimeSec, e.mtimeNsec, e.checksum.c_str(), entry.first.c_str());
+    }
+    bool ok = fclose(output) == 0;
+
+    if (!ok || rename(tmpPath.data(), indexPath.c_str()) != 0) {
+        perror("Could not write checksum index");
+        remove(tmpPath.data());
+        return false;
+    }
+    this->dirty = false;
+    return true;
+}
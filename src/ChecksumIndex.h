@@ -0,0 +1,48 @@
+#ifndef CHECKSUM_INDEX_H
+#define CHECKSUM_INDEX_H
+
+#include <string>
+#include <map>
+#include <set>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Files whose names start with this prefix are our own bookkeeping and are never listed or synced
+const std::string INTERNAL_FILE_PREFIX = ".gmm";
+const std::string CHECKSUM_INDEX_FILENAME = INTERNAL_FILE_PREFIX + "ChecksumIndex";
+
+/*
+ * On-disk cache of file checksums for one directory. An entry is only trusted while the file's inode, size and
+ * modification time all still match what they were when the checksum was computed.
+ */
+class ChecksumIndex {
+public:
+    explicit ChecksumIndex(const std::string &directory);
+
+    bool lookup(const std::string &filename, const struct stat &statStruct, std::string &checksum) const;
+
+    void update(const std::string &filename, const struct stat &statStruct, const std::string &checksum);
+
+    void retainOnly(const std::set<std::string> &filenames);
+
+    bool save();
+
+private:
+    struct Entry {
+        ino_t inode;
+        off_t size;
+        time_t mtimeSec;
+        long mtimeNsec;
+        std::string checksum;
+    };
+
+    static Entry makeEntry(const struct stat &statStruct, const std::string &checksum);
+
+    void load();
+
+    std::string directory;
+    std::map<std::string, Entry> entries;
+    bool dirty = false;
+};
+
+#endif
@@ -0,0 +1,479 @@
+#include "ChunkStore.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+using std::set;
+
+/*
+ * Layout, under CHUNK_STORE_DIRNAME:
+ *
+ *   files/<filename>              the file's checksum on the first line, then "hash length" for each chunk
+ *   chunks/<hh>/<hash>-<length>   a chunk, filed under the first two hex digits of its hash; a different chunk with
+ *                                 the same hash gets ".<copy>" on the end, and another field on its manifest line
+ *
+ * Both are written to a temporary file first and renamed into place, so a crash never leaves a partial one.
+ */
+ChunkStore::ChunkStore(const string &directory) {
+    this->directory = directory;
+    if (this->directory.back() != '/') {
+        this->directory += '/';
+    }
+    this->storeDirectory = this->directory + CHUNK_STORE_DIRNAME + "/";
+    mkdir(this->storeDirectory.c_str(), 0755);
+    mkdir((this->storeDirectory + "files").c_str(), 0755);
+    mkdir((this->storeDirectory + "chunks").c_str(), 0755);
+    load();
+    collectGarbage();
+}
+
+string ChunkStore::chunkPath(const StoredChunk &stored) const {
+    char name[80];
+    int length = snprintf(name, sizeof(name), "chunks/%02x/%016llx-%u",
+                          static_cast<unsigned int>(stored.chunk.hash >> 56),
+                          static_cast<unsigned long long>(stored.chunk.hash), stored.chunk.length);
+    if (stored.copy != 0) {
+        snprintf(name + length, sizeof(name) - length, ".%u", stored.copy);
+    }
+    return this->storeDirectory + name;
+}
+
+string ChunkStore::manifestPath(const string &filename) const {
+    return this->storeDirectory + "files/" + filename;
+}
+
+vector<MusicData> ChunkStore::list() {
+    return this->list(string(), this->files.max_size());
+}
+
+// The first count files, in order of name, whose names sort after the given one
+vector<MusicData> ChunkStore::list(const string &after, size_t count) {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    vector<MusicData> l;
+    l.reserve(std::min(count, this->files.size()));
+    for (auto it = this->files.upper_bound(after); it != this->files.end() && l.size() < count; ++it) {
+        l.push_back(MusicData(this->directory + it->first, it->second));
+    }
+    return l;
+}
+
+set<string> ChunkStore::filenames() {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    set<string> names;
+    for (const auto &file : this->files) {
+        names.insert(file.first);
+    }
+    return names;
+}
+
+// A stored file's checksum. Returns false if there's no such file.
+bool ChunkStore::lookup(const string &filename, string &checksum) {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    auto found = this->files.find(filename);
+    if (found == this->files.end()) {
+        return false;
+    }
+    checksum = found->second;
+    return true;
+}
+
+string ChunkStore::journalId() const {
+    return this->journal.id();
+}
+
+uint64_t ChunkStore::generation() {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    return this->journal.generation();
+}
+
+/*
+ * What changed after generation since, for a client that listed the store then. Returns false if the journal can't
+ * say, or more than limit files changed, in which case the client needs the whole listing again.
+ */
+bool ChunkStore::changedSince(uint64_t since, size_t limit, ListingChanges &changes) {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    set<string> filenames;
+    if (!this->journal.changedSince(since, limit, filenames)) {
+        return false;
+    }
+    changes.generation = this->journal.generation();
+    for (const auto &filename : filenames) {
+        auto found = this->files.find(filename);
+        if (found != this->files.end()) {
+            changes.changed.push_back(MusicData(this->directory + filename, found->second));
+        } else {
+            changes.removed.push_back(filename);
+        }
+    }
+    return true;
+}
+
+// Read a stored file's chunks and where each is kept. Returns false if there's no such file.
+bool ChunkStore::find(const string &filename, vector<Chunk> &chunks, vector<string> &chunkPaths) {
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        if (this->files.find(filename) == this->files.end()) {
+            return false;
+        }
+    }
+    string checksum;
+    vector<StoredChunk> stored;
+    if (!this->readManifest(filename, checksum, stored)) {
+        return false;
+    }
+    chunks.clear();
+    chunkPaths.clear();
+    for (const auto &storedChunk : stored) {
+        chunks.push_back(storedChunk.chunk);
+        chunkPaths.push_back(this->chunkPath(storedChunk));
+    }
+    return true;
+}
+
+// Move a file into the store under filename, then delete the original
+bool ChunkStore::importFile(const string &path, const string &filename) {
+    std::ifstream input(path, std::ios::binary);
+    if (!input) {
+        return false;
+    }
+    FileWriter writer(*this);
+    CRC32State crc;
+    vector<char> block(FILE_CHUNK_SIZE);
+    while (input) {
+        input.read(block.data(), block.size());
+        auto length = static_cast<size_t>(input.gcount());
+        crc.update(block.data(), length);
+        writer.write(block.data(), length);
+    }
+    if (input.bad() || !writer.finish() || !writer.commit(filename, crc.toString())) {
+        return false;
+    }
+    return remove(path.c_str()) == 0;
+}
+
+// Write a stored file back out to path as a plain file, then take it out of the store
+bool ChunkStore::exportFile(const string &filename, const string &path) {
+    string checksum;
+    vector<StoredChunk> chunks;
+    if (!this->readManifest(filename, checksum, chunks)) {
+        return false;
+    }
+
+    string tmpTemplate = path.substr(0, path.rfind('/') + 1) + INTERNAL_FILE_PREFIX + "Export.XXXXXX";
+    vector<char> tmpPath(tmpTemplate.begin(), tmpTemplate.end());
+    tmpPath.push_back('\0');
+    int fd = mkstemp(tmpPath.data());
+    if (fd < 0) {
+        perror(("Could not export " + filename).c_str());
+        return false;
+    }
+    close(fd);
+    CRC32State crc;
+    bool ok;
+    {
+        std::ofstream output(tmpPath.data(), std::ios::binary);
+        for (const auto &stored : chunks) {
+            std::ifstream chunkFile(this->chunkPath(stored), std::ios::binary);
+            string data((std::istreambuf_iterator<char>(chunkFile)), std::istreambuf_iterator<char>());
+            crc.update(data.data(), data.size());
+            output.write(data.data(), data.size());
+        }
+        output.close();
+        ok = !output.fail();
+    }
+    // A missing or damaged chunk would otherwise be written out as if it were the file. Linking rather than renaming
+    // leaves alone anything already at path
+    if (!ok || crc.toString() != checksum || link(tmpPath.data(), path.c_str()) != 0) {
+        std::cerr << "Could not export " << filename << " from the chunk store" << std::endl;
+        remove(tmpPath.data());
+        return false;
+    }
+    remove(tmpPath.data());
+
+    remove(this->manifestPath(filename).c_str());
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        this->files.erase(filename);
+        this->journal.record(filename);
+    }
+    this->release(chunks);
+    return true;
+}
+
+// Whether the stored chunk holds exactly these bytes
+bool ChunkStore::sameContents(const char *data, const StoredChunk &stored) const {
+    std::ifstream input(this->chunkPath(stored), std::ios::binary);
+    vector<char> contents(stored.chunk.length + 1);
+    input.read(contents.data(), contents.size());
+    return static_cast<size_t>(input.gcount()) == stored.chunk.length &&
+           memcmp(contents.data(), data, stored.chunk.length) == 0;
+}
+
+/*
+ * Take a reference to a chunk, storing its data if the store doesn't have it yet, and say which copy it is. A 64 bit
+ * hash can collide, so a stored chunk with the same hash is only shared if its bytes match; otherwise the chunk is
+ * stored again as another copy. Returns false if it couldn't be written.
+ */
+bool ChunkStore::addReference(const char *data, const Chunk &chunk, StoredChunk &stored) {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    vector<ChunkEntry> &copies = this->chunkEntries[chunk.hash];
+    auto freeCopy = static_cast<unsigned int>(copies.size());
+    for (unsigned int copy = 0; copy < copies.size(); copy++) {
+        if (copies[copy].references == 0) {
+            freeCopy = std::min(freeCopy, copy);
+        } else if (copies[copy].length == chunk.length && this->sameContents(data, StoredChunk{chunk, copy})) {
+            copies[copy].references++;
+            stored = StoredChunk{chunk, copy};
+            return true;
+        }
+    }
+
+    stored = StoredChunk{chunk, freeCopy};
+    string path = this->chunkPath(stored);
+    string chunkDirectory = path.substr(0, path.rfind('/') + 1);
+    mkdir(chunkDirectory.c_str(), 0755);
+    string tmpTemplate = chunkDirectory + "tmp.XXXXXX";
+    vector<char> tmpPath(tmpTemplate.begin(), tmpTemplate.end());
+    tmpPath.push_back('\0');
+    int fd = mkstemp(tmpPath.data());
+    bool ok = fd >= 0;
+    size_t written = 0;
+    while (ok && written < chunk.length) {
+        ssize_t result = ::write(fd, data + written, chunk.length - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            break;
+        }
+        written += static_cast<size_t>(result);
+    }
+    ok = ok && close(fd) == 0 && written == chunk.length;
+    if (!ok || rename(tmpPath.data(), path.c_str()) != 0) {
+        perror("Could not store chunk");
+        remove(tmpPath.data());
+        if (copies.empty()) {
+            this->chunkEntries.erase(chunk.hash);
+        }
+        return false;
+    }
+    if (freeCopy == copies.size()) {
+        copies.push_back(ChunkEntry{chunk.length, 1});
+    } else {
+        copies[freeCopy] = ChunkEntry{chunk.length, 1};
+    }
+    return true;
+}
+
+void ChunkStore::release(const vector<StoredChunk> &chunks) {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    for (const auto &stored : chunks) {
+        auto found = this->chunkEntries.find(stored.chunk.hash);
+        if (found == this->chunkEntries.end() || stored.copy >= found->second.size()) {
+            continue;
+        }
+        vector<ChunkEntry> &copies = found->second;
+        if (--copies[stored.copy].references == 0) {
+            remove(this->chunkPath(stored).c_str());
+            // Copies still in use keep their numbers, so only unused ones at the end are dropped
+            while (!copies.empty() && copies.back().references == 0) {
+                copies.pop_back();
+            }
+            if (copies.empty()) {
+                this->chunkEntries.erase(found);
+            }
+        }
+    }
+}
+
+bool ChunkStore::readManifest(const string &filename, string &checksum, vector<StoredChunk> &chunks) const {
+    std::ifstream input(this->manifestPath(filename));
+    if (!std::getline(input, checksum)) {
+        return false;
+    }
+    chunks.clear();
+    string line;
+    while (std::getline(input, line)) {
+        unsigned long long hash;
+        unsigned int length;
+        unsigned int copy = 0;
+        if (sscanf(line.c_str(), "%llx %u %u", &hash, &length, &copy) < 2) {
+            return false;
+        }
+        chunks.push_back(StoredChunk{Chunk{static_cast<uint64_t>(hash), length}, copy});
+    }
+    return true;
+}
+
+// Record a file whose chunks have all been referenced. Fails if the name is taken or isn't a plain filename.
+bool ChunkStore::writeManifest(const string &filename, const string &checksum, const vector<StoredChunk> &chunks) {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    if (!isListedFilename(filename) || this->files.find(filename) != this->files.end()) {
+        return false;
+    }
+
+    string tmpTemplate = this->storeDirectory + "manifest.XXXXXX";
+    vector<char> tmpPath(tmpTemplate.begin(), tmpTemplate.end());
+    tmpPath.push_back('\0');
+    int fd = mkstemp(tmpPath.data());
+    if (fd < 0) {
+        perror("Could not write manifest");
+        return false;
+    }
+    FILE *output = fdopen(fd, "w");
+    fprintf(output, "%s\n", checksum.c_str());
+    for (const auto &stored : chunks) {
+        fprintf(output, "%016llx %u", static_cast<unsigned long long>(stored.chunk.hash), stored.chunk.length);
+        if (stored.copy != 0) {
+            fprintf(output, " %u", stored.copy);
+        }
+        fputc('\n', output);
+    }
+    bool ok = fclose(output) == 0;
+    if (!ok || rename(tmpPath.data(), this->manifestPath(filename).c_str()) != 0) {
+        perror("Could not write manifest");
+        remove(tmpPath.data());
+        return false;
+    }
+    this->files[filename] = checksum;
+    this->journal.record(filename);
+    return true;
+}
+
+// Read every manifest, counting the references to each chunk
+void ChunkStore::load() {
+    DIR *dir = opendir((this->storeDirectory + "files").c_str());
+    if (dir == nullptr) {
+        perror("Couldn't open chunk store");
+        exit(1);
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        string filename(ent->d_name);
+        string checksum;
+        vector<StoredChunk> chunks;
+        if (filename == "." || filename == ".." || !this->readManifest(filename, checksum, chunks)) {
+            continue;
+        }
+        this->files[filename] = checksum;
+        for (const auto &stored : chunks) {
+            vector<ChunkEntry> &copies = this->chunkEntries[stored.chunk.hash];
+            if (stored.copy >= copies.size()) {
+                copies.resize(stored.copy + 1, ChunkEntry{0, 0});
+            }
+            copies[stored.copy].length = stored.chunk.length;
+            copies[stored.copy].references++;
+        }
+    }
+    closedir(dir);
+}
+
+// Delete chunks that no manifest refers to, and temporary files, left behind by a server that didn't exit cleanly
+void ChunkStore::collectGarbage() {
+    string chunksDirectory = this->storeDirectory + "chunks/";
+    DIR *dir = opendir(chunksDirectory.c_str());
+    if (dir == nullptr) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        string subdirectory = chunksDirectory + ent->d_name + "/";
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        DIR *subdir = opendir(subdirectory.c_str());
+        if (subdir == nullptr) {
+            continue;
+        }
+        struct dirent *chunkEnt;
+        while ((chunkEnt = readdir(subdir)) != nullptr) {
+            if (chunkEnt->d_name[0] == '.') {
+                continue;
+            }
+            unsigned long long hash;
+            unsigned int length;
+            unsigned int copy = 0;
+            auto found = this->chunkEntries.end();
+            if (sscanf(chunkEnt->d_name, "%16llx-%u.%u", &hash, &length, &copy) >= 2) {
+                found = this->chunkEntries.find(hash);
+            }
+            if (found == this->chunkEntries.end() || copy >= found->second.size() ||
+                found->second[copy].references == 0 || found->second[copy].length != length) {
+                remove((subdirectory + chunkEnt->d_name).c_str());
+            }
+        }
+        closedir(subdir);
+    }
+    closedir(dir);
+
+    dir = opendir(this->storeDirectory.c_str());
+    if (dir != nullptr) {
+        while ((ent = readdir(dir)) != nullptr) {
+            if (string(ent->d_name).compare(0, 9, "manifest.") == 0) {
+                remove((this->storeDirectory + ent->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+}
+
+ChunkStore::FileWriter::FileWriter(ChunkStore &store) : store(store) {}
+
+ChunkStore::FileWriter::~FileWriter() {
+    if (!this->committed) {
+        this->store.release(this->chunks);
+    }
+}
+
+bool ChunkStore::FileWriter::write(const char *data, size_t length) {
+    if (this->failed) {
+        return false;
+    }
+    this->buffer.append(data, length);
+    this->storeChunks(false);
+    return !this->failed;
+}
+
+bool ChunkStore::FileWriter::finish() {
+    if (!this->failed) {
+        this->storeChunks(true);
+    }
+    return !this->failed;
+}
+
+/*
+ * Chunk boundaries only depend on the next MAX_CHUNK_SIZE bytes, so cutting chunks whenever that much is buffered
+ * splits the file exactly as chunkFile() would
+ */
+void ChunkStore::FileWriter::storeChunks(bool final) {
+    size_t offset = 0;
+    while (this->buffer.size() - offset >= MAX_CHUNK_SIZE || (final && offset < this->buffer.size())) {
+        const char *data = this->buffer.data() + offset;
+        size_t length = nextChunkLength(data, this->buffer.size() - offset);
+        Chunk chunk{hashChunk(data, length), static_cast<uint32_t>(length)};
+        StoredChunk stored;
+        if (!this->store.addReference(data, chunk, stored)) {
+            this->failed = true;
+            break;
+        }
+        this->chunks.push_back(stored);
+        offset += length;
+    }
+    this->buffer.erase(0, offset);
+}
+
+// Add the received file to the store as filename. It must have been finished first.
+bool ChunkStore::FileWriter::commit(const string &filename, const string &checksum) {
+    if (this->failed || !this->buffer.empty() || this->committed) {
+        return false;
+    }
+    this->committed = this->store.writeManifest(filename, checksum, this->chunks);
+    return this->committed;
+}
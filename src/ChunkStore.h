@@ -0,0 +1,121 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <unordered_map>
+
+#include "Project4Common.h"
+#include "ChangeJournal.h"
+
+const std::string CHUNK_STORE_DIRNAME = INTERNAL_FILE_PREFIX + "Store";
+
+/*
+ * Content-addressed storage behind a server directory. Each file is kept as a manifest, its checksum and the list of
+ * chunks it splits into, and each distinct chunk is stored once, named by its hash and length, however many files
+ * contain it. A chunk is only shared once its bytes are found to match, so chunks whose hashes collide are each kept.
+ * Chunks are reference counted and deleted once nothing refers to them. Manifests are read from disk when
+ * they're needed; only filenames, checksums and reference counts are kept in memory. Files added since the store was
+ * opened are recorded in a ChangeJournal.
+ */
+class ChunkStore {
+public:
+    explicit ChunkStore(const std::string &directory);
+
+    ChunkStore(const ChunkStore &) = delete;
+
+    ChunkStore &operator=(const ChunkStore &) = delete;
+
+    std::vector<MusicData> list();
+
+    std::vector<MusicData> list(const std::string &after, size_t count);
+
+    std::set<std::string> filenames();
+
+    bool lookup(const std::string &filename, std::string &checksum);
+
+    std::string journalId() const;
+
+    uint64_t generation();
+
+    bool changedSince(uint64_t since, size_t limit, ListingChanges &changes);
+
+    bool find(const std::string &filename, std::vector<Chunk> &chunks, std::vector<std::string> &chunkPaths);
+
+    bool importFile(const std::string &path, const std::string &filename);
+
+    bool exportFile(const std::string &filename, const std::string &path);
+
+    // A chunk as stored. Different chunks with the same hash are numbered, the first being copy 0.
+    struct StoredChunk {
+        Chunk chunk;
+        unsigned int copy;
+    };
+
+    /*
+     * Receives a file into the store, storing each chunk as soon as it's complete. Chunks are referenced as they're
+     * stored and released again if the writer is destroyed without the file being committed.
+     */
+    class FileWriter : public FileSink {
+    public:
+        explicit FileWriter(ChunkStore &store);
+
+        FileWriter(const FileWriter &) = delete;
+
+        FileWriter &operator=(const FileWriter &) = delete;
+
+        ~FileWriter() override;
+
+        bool write(const char *data, size_t length) override;
+
+        bool finish() override;
+
+        bool commit(const std::string &filename, const std::string &checksum);
+
+    private:
+        void storeChunks(bool final);
+
+        ChunkStore &store;
+        std::string buffer;
+        std::vector<StoredChunk> chunks;
+        bool failed = false;
+        bool committed = false;
+    };
+
+private:
+    struct ChunkEntry {
+        uint32_t length;
+        unsigned int references;
+    };
+
+    std::string chunkPath(const StoredChunk &stored) const;
+
+    std::string manifestPath(const std::string &filename) const;
+
+    bool sameContents(const char *data, const StoredChunk &stored) const;
+
+    bool addReference(const char *data, const Chunk &chunk, StoredChunk &stored);
+
+    void release(const std::vector<StoredChunk> &chunks);
+
+    bool readManifest(const std::string &filename, std::string &checksum, std::vector<StoredChunk> &chunks) const;
+
+    bool writeManifest(const std::string &filename, const std::string &checksum,
+                       const std::vector<StoredChunk> &chunks);
+
+    void load();
+
+    void collectGarbage();
+
+    std::string directory;
+    std::string storeDirectory;
+    std::mutex mutex;
+    std::map<std::string, std::string> files;  // filename to checksum
+    std::unordered_map<uint64_t, std::vector<ChunkEntry>> chunkEntries;  // by hash, then by copy
+    ChangeJournal journal;
+};
+
+#endif
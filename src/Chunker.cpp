@@ -0,0 +1,188 @@
+#include "Chunker.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+
+/*
+ * The rolling hash shifts left once per byte and adds that byte's entry from this table, so its top bits depend on
+ * the last 64 bytes only. The table is generated from a fixed seed so every host gets the same one.
+ */
+static uint64_t GEAR[256];
+
+static bool fillGearTable() {
+    uint64_t state = 0x6A09E667F3BCC908ULL;
+    for (auto &entry : GEAR) {
+        // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        entry = z ^ (z >> 31);
+    }
+    return true;
+}
+
+static const bool GEAR_FILLED = fillGearTable();
+
+/*
+ * A boundary is where the hash has all of a mask's bits clear. Before the normal size a harder mask (more bits) is
+ * used and after it an easier one, which keeps chunk sizes close to the normal size.
+ */
+static const uint64_t MASK_HARD = 0xFFFF000000000000ULL;  // 16 bits
+static const uint64_t MASK_EASY = 0xFFF0000000000000ULL;  // 12 bits
+
+size_t nextChunkLength(const char *data, size_t length) {
+    if (length <= MIN_CHUNK_SIZE) {
+        return length;
+    }
+    size_t end = std::min(length, MAX_CHUNK_SIZE);
+    size_t normal = std::min(end, NORMAL_CHUNK_SIZE);
+    auto bytes = reinterpret_cast<const unsigned char *>(data);
+
+    uint64_t hash = 0;
+    size_t i = MIN_CHUNK_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + GEAR[bytes[i]];
+        if ((hash & MASK_HARD) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + GEAR[bytes[i]];
+        if ((hash & MASK_EASY) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+// XXH64, reading words as little-endian so the hash is the same on every host
+static const uint64_t PRIME1 = 11400714785074694791ULL;
+static const uint64_t PRIME2 = 14029467366897019727ULL;
+static const uint64_t PRIME3 = 1609587929392839161ULL;
+static const uint64_t PRIME4 = 9650029242287828579ULL;
+static const uint64_t PRIME5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) |
+           (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint64_t xxRound(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t val) {
+    acc ^= xxRound(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+uint64_t hashChunk(const char *data, size_t length) {
+    auto p = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        uint64_t v1 = PRIME1 + PRIME2;
+        uint64_t v2 = PRIME2;
+        uint64_t v3 = 0;
+        uint64_t v4 = 0 - PRIME1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = xxRound(v1, read64(p));
+            v2 = xxRound(v2, read64(p + 8));
+            v3 = xxRound(v3, read64(p + 16));
+            v4 = xxRound(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    } else {
+        h = PRIME5;
+    }
+    h += length;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxRound(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+vector<Chunk> chunkData(const char *data, size_t length) {
+    vector<Chunk> chunks;
+    size_t offset = 0;
+    while (offset < length) {
+        size_t chunkLength = nextChunkLength(data + offset, length - offset);
+        chunks.push_back(Chunk{hashChunk(data + offset, chunkLength), static_cast<uint32_t>(chunkLength)});
+        offset += chunkLength;
+    }
+    return chunks;
+}
+
+// The file is mapped rather than read so that chunking it doesn't need a copy of it in memory
+bool chunkFile(const string &path, vector<Chunk> &chunks) {
+    chunks.clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) {
+        close(fd);
+        return false;
+    }
+    auto size = static_cast<size_t>(fileStat.st_size);
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(mapped, size, MADV_SEQUENTIAL);
+#endif
+    chunks = chunkData(static_cast<const char *>(mapped), size);
+    munmap(mapped, size);
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+/*
+ * Content-defined chunking (FastCDC). Chunk boundaries are picked by a rolling hash of the last few dozen bytes, so an
+ * edit only changes the chunks it touches; everything after it splits the same way it did before, even if the edit
+ * changed the file's length. Both hosts must use the same parameters for their chunks to line up.
+ */
+const size_t MIN_CHUNK_SIZE = 4 * 1024;
+const size_t NORMAL_CHUNK_SIZE = 16 * 1024;
+const size_t MAX_CHUNK_SIZE = 64 * 1024;
+
+struct Chunk {
+    uint64_t hash;
+    uint32_t length;
+};
+
+// Length of the chunk at the start of data, which is all of it if that's less than MIN_CHUNK_SIZE
+size_t nextChunkLength(const char *data, size_t length);
+
+uint64_t hashChunk(const char *data, size_t length);
+
+std::vector<Chunk> chunkData(const char *data, size_t length);
+
+// Split a file into chunks. Returns false if it can't be read.
+bool chunkFile(const std::string &path, std::vector<Chunk> &chunks);
+
+#endif
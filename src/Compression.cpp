@@ -0,0 +1,210 @@
+#include "Compression.h"
+
+#include <algorithm>
+#include <vector>
+#include <cstring>
+#include <cctype>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using std::string;
+using std::vector;
+
+/*
+ * Each sequence starts with a token byte: the top 4 bits are the number of literals and the bottom 4 the length of
+ * the match less MIN_MATCH. A field of 15 is continued in the bytes after it (after the literals, for the match),
+ * each added on until one isn't 255. The literals follow, then the match's distance back as 2 little-endian bytes.
+ * The last sequence has only literals; it ends where the block does.
+ */
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 14;
+// Matches stop this far from the end, and aren't looked for any closer than MATCH_SEARCH_LIMIT, so reading four
+// bytes at a time never runs off the end of the input
+static const size_t LAST_LITERALS = 5;
+static const size_t MATCH_SEARCH_LIMIT = 12;
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hashSequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void appendLength(string &out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        out += static_cast<char>(255);
+    }
+    out += static_cast<char>(length);
+}
+
+// A matchLength of 0 means this is the last sequence, with no match
+static void appendSequence(string &out, const unsigned char *literals, size_t literalLength, size_t offset,
+                           size_t matchLength) {
+    size_t matchField = matchLength == 0 ? 0 : matchLength - MIN_MATCH;
+    out += static_cast<char>((std::min<size_t>(literalLength, 15) << 4) | std::min<size_t>(matchField, 15));
+    if (literalLength >= 15) {
+        appendLength(out, literalLength - 15);
+    }
+    out.append(reinterpret_cast<const char *>(literals), literalLength);
+    if (matchLength == 0) {
+        return;
+    }
+    out += static_cast<char>(offset & 0xff);
+    out += static_cast<char>(offset >> 8);
+    if (matchField >= 15) {
+        appendLength(out, matchField - 15);
+    }
+}
+
+size_t compressBound(size_t length) {
+    return length + length / 255 + 16;
+}
+
+void compressBlock(const char *data, size_t length, string &out) {
+    auto src = reinterpret_cast<const unsigned char *>(data);
+    size_t anchor = 0;  // start of the literals not yet written out
+
+    if (length > MATCH_SEARCH_LIMIT) {
+        vector<uint32_t> table(1 << HASH_BITS, 0);
+        size_t matchLimit = length - LAST_LITERALS;
+        size_t searchEnd = length - MATCH_SEARCH_LIMIT;
+        size_t misses = 0;
+        size_t pos = 1;
+        while (pos <= searchEnd) {
+            uint32_t hash = hashSequence(read32(src + pos));
+            size_t candidate = table[hash];
+            table[hash] = static_cast<uint32_t>(pos);
+            if (pos - candidate > MAX_OFFSET || read32(src + candidate) != read32(src + pos)) {
+                // Step further the longer it's been since the last match, so incompressible data is passed over fast
+                pos += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+                pos--;
+                candidate--;
+            }
+            size_t matchLength = MIN_MATCH;
+            while (pos + matchLength < matchLimit && src[pos + matchLength] == src[candidate + matchLength]) {
+                matchLength++;
+            }
+            appendSequence(out, src + anchor, pos - anchor, pos - candidate, matchLength);
+            pos += matchLength;
+            anchor = pos;
+        }
+    }
+    appendSequence(out, src + anchor, length - anchor, 0, 0);
+}
+
+// Add the continuation bytes of a length field to length. Returns false if the input ends first.
+static bool readLength(const unsigned char *&in, const unsigned char *end, size_t &length) {
+    unsigned char byte;
+    do {
+        if (in >= end) {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool decompressBlock(const char *data, size_t length, char *dest, size_t originalLength) {
+    auto in = reinterpret_cast<const unsigned char *>(data);
+    const unsigned char *end = in + length;
+    size_t outPos = 0;
+
+    while (in < end) {
+        unsigned char token = *in++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !readLength(in, end, literalLength)) {
+            return false;
+        }
+        if (literalLength > static_cast<size_t>(end - in) || literalLength > originalLength - outPos) {
+            return false;
+        }
+        memcpy(dest + outPos, in, literalLength);
+        in += literalLength;
+        outPos += literalLength;
+        if (in == end) {
+            return outPos == originalLength;
+        }
+
+        if (end - in < 2) {
+            return false;
+        }
+        size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(in, end, matchLength)) {
+            return false;
+        }
+        matchLength += MIN_MATCH;
+        if (offset == 0 || offset > outPos || matchLength > originalLength - outPos) {
+            return false;
+        }
+        // A match may overlap what it's copying, to repeat a short run, so it has to go a byte at a time then
+        if (offset >= matchLength) {
+            memcpy(dest + outPos, dest + outPos - offset, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; i++) {
+                dest[outPos + i] = dest[outPos + i - offset];
+            }
+        }
+        outPos += matchLength;
+    }
+    return false;
+}
+
+// Formats that are compressed already; another pass over them only costs time
+static const char *const COMPRESSED_EXTENSIONS[] = {
+        "mp3", "flac", "ogg", "oga", "opus", "m4a", "aac", "wma", "ape", "wv", "mp4",
+        "jpg", "jpeg", "png", "gif", "webp", "zip", "gz", "bz2", "xz", "7z", "rar",
+};
+
+static const size_t COMPRESSION_SAMPLE_SIZE = 32 * 1024;
+
+/*
+ * Anything not known to be compressed already is judged by compressing a sample from the middle of it, where a header
+ * or a quiet intro won't make it look better than it is. It's worth it if the sample shrinks by a tenth or more.
+ */
+bool isWorthCompressing(const string &filename, const string &samplePath) {
+    size_t dot = filename.rfind('.');
+    if (dot != string::npos) {
+        string extension = filename.substr(dot + 1);
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        for (const char *compressed : COMPRESSED_EXTENSIONS) {
+            if (extension == compressed) {
+                return false;
+            }
+        }
+    }
+
+    int fd = open(samplePath.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t size = static_cast<size_t>(fileStat.st_size);
+    size_t sampleLength = std::min(size, COMPRESSION_SAMPLE_SIZE);
+    vector<char> sample(sampleLength);
+    ssize_t bytesRead = pread(fd, sample.data(), sampleLength, static_cast<off_t>((size - sampleLength) / 2));
+    close(fd);
+    if (bytesRead <= 0) {
+        return false;
+    }
+
+    string compressed;
+    compressBlock(sample.data(), static_cast<size_t>(bytesRead), compressed);
+    return compressed.size() * 10 <= static_cast<size_t>(bytesRead) * 9;
+}
@@ -0,0 +1,26 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+#include <cstddef>
+
+/*
+ * A small LZ77 block codec in the style of LZ4: a block is a run of sequences, each some literal bytes followed by a
+ * copy of earlier output, and matches are found with a single hash table lookup per position. It's fast enough to
+ * keep up with the network, and skips quickly over data that doesn't compress. Blocks are independent of each other
+ * and no more than 64 KiB back is ever referenced.
+ */
+
+// The most compressBlock() can write for length bytes of input
+size_t compressBound(size_t length);
+
+// Append the compressed form of length bytes of data to out
+void compressBlock(const char *data, size_t length, std::string &out);
+
+// Decompress a block into dest, which has room for exactly its original length. Returns false if it isn't valid.
+bool decompressBlock(const char *data, size_t length, char *dest, size_t originalLength);
+
+// Whether a file is likely to get smaller compressed. samplePath is read to find out, unless filename says already.
+bool isWorthCompressing(const std::string &filename, const std::string &samplePath);
+
+#endif
@@ -0,0 +1,33 @@
+#include "DirectoryLock.h"
+
+#include <map>
+#include <mutex>
+
+DirectoryLock::DirectoryLock(const std::string &directory, Mode mode) {
+    this->lock = forDirectory(directory);
+    if (mode == Exclusive) {
+        pthread_rwlock_wrlock(this->lock);
+    } else {
+        pthread_rwlock_rdlock(this->lock);
+    }
+}
+
+DirectoryLock::~DirectoryLock() {
+    pthread_rwlock_unlock(this->lock);
+}
+
+// Locks are created the first time a directory is seen and live until the process exits
+pthread_rwlock_t *DirectoryLock::forDirectory(const std::string &directory) {
+    static std::mutex registryMutex;
+    static std::map<std::string, pthread_rwlock_t *> registry;
+
+    std::lock_guard<std::mutex> guard(registryMutex);
+    auto it = registry.find(directory);
+    if (it != registry.end()) {
+        return it->second;
+    }
+    auto *lock = new pthread_rwlock_t;
+    pthread_rwlock_init(lock, nullptr);
+    registry[directory] = lock;
+    return lock;
+}
@@ -0,0 +1,32 @@
+#ifndef DIRECTORY_LOCK_H
+#define DIRECTORY_LOCK_H
+
+#include <string>
+#include <pthread.h>
+
+/*
+ * Scoped reader/writer lock on a directory, shared by every thread in the process. Anything that changes which
+ * files are in a directory holds it exclusively; listings hold it shared so they see a consistent set of files.
+ */
+class DirectoryLock {
+public:
+    enum Mode {
+        Shared,
+        Exclusive
+    };
+
+    DirectoryLock(const std::string &directory, Mode mode);
+
+    ~DirectoryLock();
+
+    DirectoryLock(const DirectoryLock &) = delete;
+
+    DirectoryLock &operator=(const DirectoryLock &) = delete;
+
+private:
+    static pthread_rwlock_t *forDirectory(const std::string &directory);
+
+    pthread_rwlock_t *lock;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include "DirectoryWatcher.h"
+
+#include <cstdio>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+using std::string;
+using std::vector;
+using std::set;
+
+DirectoryWatcher::DirectoryWatcher(const string &directory)
+        : directory(directory), inotifyFd(-1), stopPipe{-1, -1}, index(directory) {
+    if (this->directory.back() != '/') {
+        this->directory += '/';
+    }
+}
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (this->thread.joinable()) {
+        char stop = 0;
+        if (write(this->stopPipe[1], &stop, 1) < 0) {
+            perror("Could not stop the directory watcher");
+        }
+        this->thread.join();
+    }
+    for (int fd : {this->inotifyFd, this->stopPipe[0], this->stopPipe[1]}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+DirectoryWatcher::Entry DirectoryWatcher::makeEntry(const struct stat &statStruct, const string &checksum) {
+    Entry e;
+    e.inode = statStruct.st_ino;
+    e.size = statStruct.st_size;
+    e.mtimeSec = statStruct.st_mtime;
+    e.mtimeNsec = statStruct.st_mtim.tv_nsec;
+    e.checksum = checksum;
+    return e;
+}
+
+bool DirectoryWatcher::matches(const Entry &entry, const struct stat &statStruct) {
+    return entry.inode == statStruct.st_ino && entry.size == statStruct.st_size &&
+           entry.mtimeSec == statStruct.st_mtime && entry.mtimeNsec == statStruct.st_mtim.tv_nsec;
+}
+
+/*
+ * Start watching, then read the whole directory in, so that nothing that changes while it's being read is missed.
+ * Returns false if the directory can't be watched, in which case listings should come from list() as before.
+ */
+bool DirectoryWatcher::start() {
+#ifdef __linux__
+    this->inotifyFd = inotify_init1(IN_CLOEXEC);
+    uint32_t events = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+    if (this->inotifyFd < 0 || inotify_add_watch(this->inotifyFd, this->directory.c_str(), events) < 0 ||
+        pipe(this->stopPipe) != 0) {
+        perror(("Could not watch " + this->directory).c_str());
+        return false;
+    }
+    this->rescan();
+    this->thread = std::thread(&DirectoryWatcher::run, this);
+    return true;
+#else
+    return false;
+#endif
+}
+
+vector<MusicData> DirectoryWatcher::list() {
+    return this->list(string(), this->files.max_size());
+}
+
+// Don't answer with checksums that a refresh already under way is about to replace
+void DirectoryWatcher::waitForRefresh(std::unique_lock<std::mutex> &lock) {
+    unsigned long seen = this->refreshCount;
+    this->refreshed.wait(lock, [this, seen] { return !this->refreshing || this->refreshCount > seen; });
+}
+
+// The first count files, in order of name, whose names sort after the given one
+vector<MusicData> DirectoryWatcher::list(const string &after, size_t count) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->waitForRefresh(lock);
+
+    vector<MusicData> l;
+    l.reserve(std::min(count, this->files.size()));
+    for (auto it = this->files.upper_bound(after); it != this->files.end() && l.size() < count; ++it) {
+        l.push_back(MusicData(this->directory + it->first, it->second.checksum));
+    }
+    return l;
+}
+
+// A file's checksum, without copying the rest of the listing. Returns false if there's no such file.
+bool DirectoryWatcher::lookup(const string &filename, string &checksum) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->waitForRefresh(lock);
+
+    auto found = this->files.find(filename);
+    if (found == this->files.end()) {
+        return false;
+    }
+    checksum = found->second.checksum;
+    return true;
+}
+
+// Record a file the server has just put in place itself, so the event for it doesn't make it get read again
+void DirectoryWatcher::update(const string &filename, const string &checksum) {
+    struct stat statStruct;
+    if (stat((this->directory + filename).c_str(), &statStruct) != 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->mutex);
+    this->setEntry(filename, makeEntry(statStruct, checksum));
+}
+
+string DirectoryWatcher::journalId() const {
+    return this->journal.id();
+}
+
+uint64_t DirectoryWatcher::generation() {
+    std::lock_guard<std::mutex> guard(this->mutex);
+    return this->journal.generation();
+}
+
+/*
+ * What changed after generation since, for a client that listed the directory then. Returns false if the journal
+ * can't say, or more than limit files changed, in which case the client needs the whole listing again.
+ */
+bool DirectoryWatcher::changedSince(uint64_t since, size_t limit, ListingChanges &changes) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->waitForRefresh(lock);
+
+    set<string> filenames;
+    if (!this->journal.changedSince(since, limit, filenames)) {
+        return false;
+    }
+    changes.generation = this->journal.generation();
+    for (const auto &filename : filenames) {
+        auto found = this->files.find(filename);
+        if (found != this->files.end()) {
+            changes.changed.push_back(MusicData(this->directory + filename, found->second.checksum));
+        } else {
+            changes.removed.push_back(filename);
+        }
+    }
+    return true;
+}
+
+// Record a file's entry, journalling it if the file is new or its contents changed. Call with the mutex held.
+void DirectoryWatcher::setEntry(const string &filename, const Entry &entry) {
+    auto found = this->files.find(filename);
+    if (found == this->files.end() || found->second.checksum != entry.checksum) {
+        this->journal.record(filename);
+    }
+    this->files[filename] = entry;
+}
+
+// Call with the mutex held
+void DirectoryWatcher::eraseEntry(std::map<string, Entry>::iterator entry) {
+    this->journal.record(entry->first);
+    this->files.erase(entry);
+}
+
+void DirectoryWatcher::run() {
+#ifdef __linux__
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    while (true) {
+        struct pollfd fds[2];
+        fds[0].fd = this->inotifyFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = this->stopPipe[0];
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Directory watcher stopped");
+            return;
+        }
+        if (fds[1].revents != 0) {
+            return;
+        }
+
+        ssize_t length = read(this->inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0) {
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            perror("Directory watcher stopped");
+            return;
+        }
+        set<string> changed;
+        bool overflowed = false;
+        for (char *p = buffer; p < buffer + length;) {
+            auto *event = reinterpret_cast<struct inotify_event *>(p);
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+            } else if (event->len > 0) {
+                changed.insert(event->name);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            this->refreshing = true;
+        }
+        // Too many events to queue means some were dropped, so nothing short of looking at everything will do
+        if (overflowed) {
+            this->rescan();
+        } else {
+            this->refresh(changed);
+        }
+        {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            this->refreshing = false;
+            this->refreshCount++;
+        }
+        this->refreshed.notify_all();
+    }
+#endif
+}
+
+/*
+ * Bring the given files' entries up to date. Files whose inode, size and modification time still match what's
+ * recorded, in memory or in the checksum index, keep their checksums; the rest are read again, in parallel.
+ */
+void DirectoryWatcher::refresh(const set<string> &filenames) {
+    vector<string> changed;
+    vector<struct stat> changedStats;
+    for (const auto &filename : filenames) {
+        if (!isListedFilename(filename)) {
+            continue;
+        }
+        struct stat statStruct;
+        bool exists = stat((this->directory + filename).c_str(), &statStruct) == 0 && S_ISREG(statStruct.st_mode);
+
+        std::lock_guard<std::mutex> guard(this->mutex);
+        auto found = this->files.find(filename);
+        if (!exists) {
+            if (found != this->files.end()) {
+                this->eraseEntry(found);
+            }
+            continue;
+        }
+        string checksum;
+        if (found != this->files.end() && matches(found->second, statStruct)) {
+            if (!this->index.lookup(filename, statStruct, checksum)) {
+                this->index.update(filename, statStruct, found->second.checksum);
+            }
+            continue;
+        }
+        if (this->index.lookup(filename, statStruct, checksum)) {
+            this->setEntry(filename, makeEntry(statStruct, checksum));
+            continue;
+        }
+        changed.push_back(filename);
+        changedStats.push_back(statStruct);
+    }
+
+    vector<string> checksums(changed.size());
+    runInParallel(changed.size(), [this, &changed, &checksums](size_t i) {
+        checksums[i] = computeCRC(this->directory + changed[i]);
+    });
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        for (size_t i = 0; i < changed.size(); i++) {
+            this->setEntry(changed[i], makeEntry(changedStats[i], checksums[i]));
+        }
+    }
+    for (size_t i = 0; i < changed.size(); i++) {
+        this->index.update(changed[i], changedStats[i], checksums[i]);
+    }
+    this->index.save();
+}
+
+// Compare the whole directory with what's recorded, for the start and for when events may have been missed
+void DirectoryWatcher::rescan() {
+    set<string> filenames;
+    for (const auto &path : directoryFileListing(this->directory)) {
+        filenames.insert(getFilename(path));
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->mutex);
+        for (auto it = this->files.begin(); it != this->files.end();) {
+            if (filenames.count(it->first) > 0) {
+                ++it;
+            } else {
+                this->eraseEntry(it++);
+            }
+        }
+    }
+    this->index.retainOnly(filenames);
+    this->refresh(filenames);
+}
@@ -0,0 +1,88 @@
+#ifndef DIRECTORY_WATCHER_H
+#define DIRECTORY_WATCHER_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "Project4Common.h"
+#include "ChangeJournal.h"
+
+/*
+ * The listing of a directory, kept in memory and brought up to date by inotify as files change, so a listing doesn't
+ * touch the disk at all. A background thread stats each file an event names and only checksums it again if its
+ * inode, size or modification time moved. Checksums are saved to the directory's ChecksumIndex as well, so that a
+ * restart doesn't read every file again. Every file added, changed or deleted is recorded in a ChangeJournal too.
+ * Only available on Linux; start() says whether it's running.
+ */
+class DirectoryWatcher {
+public:
+    explicit DirectoryWatcher(const std::string &directory);
+
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+
+    DirectoryWatcher &operator=(const DirectoryWatcher &) = delete;
+
+    ~DirectoryWatcher();
+
+    bool start();
+
+    std::vector<MusicData> list();
+
+    std::vector<MusicData> list(const std::string &after, size_t count);
+
+    bool lookup(const std::string &filename, std::string &checksum);
+
+    void update(const std::string &filename, const std::string &checksum);
+
+    std::string journalId() const;
+
+    uint64_t generation();
+
+    bool changedSince(uint64_t since, size_t limit, ListingChanges &changes);
+
+private:
+    struct Entry {
+        ino_t inode;
+        off_t size;
+        time_t mtimeSec;
+        long mtimeNsec;
+        std::string checksum;
+    };
+
+    static Entry makeEntry(const struct stat &statStruct, const std::string &checksum);
+
+    static bool matches(const Entry &entry, const struct stat &statStruct);
+
+    void waitForRefresh(std::unique_lock<std::mutex> &lock);
+
+    void setEntry(const std::string &filename, const Entry &entry);
+
+    void eraseEntry(std::map<std::string, Entry>::iterator entry);
+
+    void run();
+
+    void refresh(const std::set<std::string> &filenames);
+
+    void rescan();
+
+    std::string directory;
+    int inotifyFd;
+    int stopPipe[2];
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable refreshed;
+    std::map<std::string, Entry> files;
+    bool refreshing = false;
+    unsigned long refreshCount = 0;  // refreshes finished so far
+    ChangeJournal journal;
+    ChecksumIndex index;  // only used by the watching thread once it has started
+};
+
+#endif
@@ -1,59 +1,250 @@
 #include <iomanip>
+#include <cstring>
+#include <cstdint>
 #include "HappyPathJSON.h"
 
-std::string JSON::trim(const std::string &str) {
-    std::string s = str;
-    // Removes all spaces from the beginning of the string
-    while (s.size() && isspace(s.front())) {
-        s.erase(s.begin());
+JSONArena::JSONArena(size_t blockSize) : pos(nullptr), end(nullptr), blockSize(blockSize), allocated(0) {}
+
+JSONArena::~JSONArena() {
+    for (void *block : this->blocks) {
+        ::operator delete(block);
     }
-    // Removes all spaces from the end of the string
-    while (!s.empty() && isspace(s[s.size() - 1])) {
-        s.erase(s.end() - 1);
+}
+
+void *JSONArena::allocate(size_t bytes, size_t alignment) {
+    this->allocated += bytes;
+    uintptr_t p = (reinterpret_cast<uintptr_t>(this->pos) + alignment - 1) & ~(uintptr_t(alignment) - 1);
+    if (this->pos == nullptr || p + bytes > reinterpret_cast<uintptr_t>(this->end)) {
+        // Big allocations, like file data, get a block to themselves so the current block isn't wasted
+        if (bytes > this->blockSize / 4) {
+            this->blocks.push_back(::operator new(bytes));
+            return this->blocks.back();
+        }
+        this->blocks.push_back(::operator new(this->blockSize));
+        this->pos = static_cast<char *>(this->blocks.back());
+        this->end = this->pos + this->blockSize;
+        p = reinterpret_cast<uintptr_t>(this->pos);
     }
-    return s;
+    this->pos = reinterpret_cast<char *>(p + bytes);
+    return reinterpret_cast<void *>(p);
 }
 
-JSON::JSON(const std::string &j) : JSON(j, false) {};
+const std::string &JSONArena::keep(std::string text) {
+    this->texts.push_back(std::move(text));
+    return this->texts.back();
+}
+
+// Allocates from an arena if it has one and from the heap otherwise. Arena memory is never freed individually.
+template<typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator() : arena(nullptr) {}
+
+    explicit ArenaAllocator(JSONArena *arena) : arena(arena) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) {
+        if (this->arena != nullptr) {
+            return static_cast<T *>(this->arena->allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t) {
+        if (this->arena == nullptr) {
+            ::operator delete(p);
+        }
+    }
+
+    JSONArena *arena;
+};
 
-JSON::JSON(double i) {
-    this->iNumber = true;
-    this->numberVal = i;
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena == b.arena; }
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena != b.arena; }
+
+/*
+ * Allocator for payloads themselves. The shared_ptr control block keeps a copy of it, so the arena lives for as long
+ * as any payload allocated from it.
+ */
+template<typename T>
+class ArenaOwner : public ArenaAllocator<T> {
+public:
+    explicit ArenaOwner(const std::shared_ptr<JSONArena> &owner) : ArenaAllocator<T>(owner.get()), owner(owner) {}
+
+    template<typename U>
+    ArenaOwner(const ArenaOwner<U> &other) : ArenaAllocator<T>(other), owner(other.owner) {}
+
+    std::shared_ptr<JSONArena> owner;
 };
 
-JSON::JSON(std::map<std::string, JSON> &m) {
-    this->iObject = true;
-    this->objectEls = m;
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>> ArenaString;
+
+struct JSON::Payload {
+    std::vector<JSON, ArenaAllocator<JSON>> arrayEls;
+    std::map<std::string, JSON, std::less<std::string>, ArenaAllocator<std::pair<const std::string, JSON>>> objectEls;
+    ArenaString stringVal;
+    StringWriter stringWriter;  // set instead of stringVal for strings that are written on demand
+    // Set instead of stringVal for strings from a view. The text is still escaped and belongs to the arena.
+    const char *raw = nullptr;
+    size_t rawLength = 0;
+    // Cleared once a reference into the payload has been handed out. The value can then be changed through that
+    // reference at any time, so copies of it get a payload of their own.
+    bool shareable = true;
+
+    explicit Payload(JSONArena *arena = nullptr)
+            : arrayEls(ArenaAllocator<JSON>(arena)),
+              objectEls(std::less<std::string>(), ArenaAllocator<std::pair<const std::string, JSON>>(arena)),
+              stringVal(ArenaAllocator<char>(arena)) {}
+
+    // Copies go on the heap, with raw strings unescaped since they can outlive the arena; only parsing allocates from one
+    Payload(const Payload &p)
+            : arrayEls(p.arrayEls.begin(), p.arrayEls.end()),
+              objectEls(p.objectEls.begin(), p.objectEls.end()),
+              stringVal(p.stringVal.data(), p.stringVal.size()),
+              stringWriter(p.stringWriter) {
+        if (p.raw != nullptr) {
+            JSON::appendUnescaped(this->stringVal, p.raw, p.raw + p.rawLength);
+        }
+    }
 };
 
-JSON::JSON(std::vector<JSON> &js) {
-    this->iArray = true;
-    this->arrayEls = js;
+JSON::JSON(const std::string &j) : JSON(j, false) {};
+
+JSON::JSON(const JSON &j) : type(j.type), numberVal(0) {
+    this->copyScalar(j);
+    if (j.payload && !j.payload->shareable) {
+        this->payload = std::make_shared<Payload>(*j.payload);
+        this->payload->shareable = true;
+    } else {
+        this->payload = j.payload;
+    }
+}
+
+JSON::JSON(JSON &&j) noexcept : type(j.type), numberVal(0), payload(std::move(j.payload)) {
+    this->copyScalar(j);
+    j.type = Type::Blank;
 }
 
-JSON::JSON(const std::string &j, bool plainString) {
+JSON::JSON(double i) : type(Type::Number), numberVal(i) {};
+
+JSON::JSON(std::map<std::string, JSON> m) : JSON() {
+    this->reset(Type::Object);
+    this->payload->objectEls.insert(std::make_move_iterator(m.begin()), std::make_move_iterator(m.end()));
+};
+
+JSON::JSON(std::vector<JSON> js) : JSON() {
+    this->reset(Type::Array);
+    this->payload->arrayEls.assign(std::make_move_iterator(js.begin()), std::make_move_iterator(js.end()));
+}
+
+JSON::JSON(const std::string &j, bool plainString) : JSON() {
     if (plainString) {
-        this->iString = true;
-        this->stringVal = j;
+        this->reset(Type::String);
+        this->payload->stringVal.assign(j.data(), j.size());
     } else {
-        this->origString = j;
-        parse();
+        parse(j);
     }
 };
 
+JSON::JSON(const StringWriter &stringWriter) : JSON() {
+    this->reset(Type::String);
+    this->payload->stringWriter = stringWriter;
+}
+
+JSON::JSON(const std::string &j, const std::shared_ptr<JSONArena> &arena) : JSON() {
+    parse(j, arena);
+}
+
+JSON JSON::view(std::string j, const std::shared_ptr<JSONArena> &arena) {
+    JSON value;
+    value.parse(arena->keep(std::move(j)), arena, true);
+    return value;
+}
+
+JSON &JSON::operator=(const JSON &j) {
+    if (this != &j) {
+        // j may live inside this value's payload, so copy it before letting go of anything
+        JSON copy(j);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+JSON &JSON::operator=(JSON &&j) noexcept {
+    if (this != &j) {
+        std::shared_ptr<Payload> p = std::move(j.payload);
+        this->type = j.type;
+        this->copyScalar(j);
+        j.type = Type::Blank;
+        this->payload = std::move(p);
+    }
+    return *this;
+}
+
+void JSON::copyScalar(const JSON &j) {
+    if (j.type == Type::Bool) {
+        this->boolVal = j.boolVal;
+    } else {
+        this->numberVal = j.numberVal;
+    }
+}
+
+// Make this an empty value of type t, allocated from arena if there is one
+void JSON::reset(Type t, const std::shared_ptr<JSONArena> &arena) {
+    this->type = t;
+    this->numberVal = 0;
+    if ((t == Type::String || t == Type::Array || t == Type::Object) && arena) {
+        this->payload = std::allocate_shared<Payload>(ArenaOwner<Payload>(arena), arena.get());
+    } else if (t == Type::String || t == Type::Array || t == Type::Object) {
+        this->payload = std::make_shared<Payload>();
+    } else {
+        this->payload.reset();
+    }
+}
+
+const JSON::Payload &JSON::data() const {
+    static const Payload empty;
+    return this->payload ? *this->payload : empty;
+}
+
+// The payload for changing, copied first if any other value shares it
+JSON::Payload &JSON::mutableData() {
+    if (!this->payload) {
+        this->payload = std::make_shared<Payload>();
+    } else if (this->payload.use_count() > 1) {
+        this->payload = std::make_shared<Payload>(*this->payload);
+        this->payload->shareable = true;
+    }
+    return *this->payload;
+}
+
+// The payload for handing out a reference into, which stops it being shared from now on
+JSON::Payload &JSON::mutableDataForReference() {
+    Payload &d = this->mutableData();
+    d.shareable = false;
+    return d;
+}
+
 bool JSON::hasKey(const std::string &k) const {
-    if (this->iArray) {
+    if (this->type != Type::Object) {
         return false;
     }
-    return this->objectEls.find(k) != this->objectEls.end();
+    return this->data().objectEls.find(k) != this->data().objectEls.end();
 };
 
 JSON &JSON::operator[](unsigned int i) {
-    if (this->iArray) {
-        if (i >= this->arrayEls.size()) {
+    if (this->type == Type::Array) {
+        if (i >= this->data().arrayEls.size()) {
             throw std::out_of_range("Index is out of range");
         }
-        return this->arrayEls.at(i);
+        return this->mutableDataForReference().arrayEls[i];
     }
     throw std::domain_error("Cannot access the numeric index of JSON non-array");
 };
@@ -62,38 +253,70 @@ JSON &JSON::operator[](const std::string &s) {
     if (this->isBlank()) {
         this->makeObject();
     }
-    if (!this->iObject && JSON::isNumeric(s)) {
+    if (this->type != Type::Object && JSON::isNumeric(s)) {
         return this->operator[]((unsigned int) std::stoi(s));
     }
-    if (this->iObject) {
-        if (!this->hasKey(s)) {
-            this->objectEls.emplace(s, JSON());
-        }
-        return this->objectEls.at(s);
+    if (this->type == Type::Object) {
+        return this->mutableDataForReference().objectEls.emplace(s, JSON()).first->second;
     }
     throw std::domain_error("Cannot access the string key on a JSON non-object");
 };
 
 const JSON &JSON::operator[](unsigned int i) const {
-    if (this->iArray) {
-        if (i >= this->arrayEls.size()) {
+    if (this->type == Type::Array) {
+        if (i >= this->data().arrayEls.size()) {
             throw std::out_of_range("Index is out of range");
         }
-        return this->arrayEls.at(i);
+        return this->data().arrayEls[i];
     }
     throw std::domain_error("Cannot access the numeric index of JSON non-array");
 };
 
 const JSON &JSON::operator[](const std::string &s) const {
-    if (!this->iObject && JSON::isNumeric(s)) {
+    if (this->type != Type::Object && JSON::isNumeric(s)) {
         return this->operator[]((unsigned int) std::stoi(s));
     }
-    if (this->iObject && this->hasKey(s)) {
-        return this->objectEls.at(s);
+    if (this->type == Type::Object) {
+        auto it = this->data().objectEls.find(s);
+        if (it != this->data().objectEls.end()) {
+            return it->second;
+        }
     }
     throw std::domain_error("Cannot access the string key on a JSON non-object or key doesn't exist");
 };
 
+bool JSON::operator==(const JSON &rhs) const {
+    if (this->type != rhs.type) {
+        return false;
+    }
+    switch (this->type) {
+        case Type::Array:
+            return this->data().arrayEls == rhs.data().arrayEls;
+        case Type::Object:
+            return this->data().objectEls == rhs.data().objectEls;
+        case Type::Bool:
+            return this->boolVal == rhs.boolVal;
+        case Type::Null:
+            return true;
+        case Type::String:
+            return this->getString() == rhs.getString();
+        case Type::Number:
+            return this->numberVal == rhs.numberVal;
+        default:
+            return false;
+    }
+}
+
+ssize_t JSON::size() const {
+    if (this->type == Type::Array) {
+        return this->data().arrayEls.size();
+    } else if (this->type == Type::Object) {
+        return this->data().objectEls.size();
+    } else {
+        return -1;
+    }
+}
+
 bool JSON::isNumeric(const std::string &s) {
     return !s.empty() && s.find_first_not_of("0123456789.-") == std::string::npos
            // Zero or one decimal
@@ -105,142 +328,193 @@ bool JSON::isNumeric(const std::string &s) {
 }
 
 void JSON::operator=(const std::string &s) {
-    std::string st = s;
-
+    *this = JSON();
     if (s[0] != '"' && s[0] != '{' && s[0] != '[' && !JSON::isNumeric(s)) {
-        st = '"' + s + '"';
+        // Anything else is taken as the contents of a string, escapes and all
+        this->reset(Type::String);
+        appendUnescaped(this->payload->stringVal, s.data(), s.data() + s.size());
+        return;
     }
-    this->origString = st;
-    this->parse();
+    this->parse(s);
 }
 
 void JSON::operator=(double i) {
-    if (this->iString) {
-        std::stringstream ss;
-        ss << i;
-        this->origString = ss.str();
-        parse();
-    } else if (this->iNumber) {
+    if (this->type == Type::String) {
+        *this = JSON(i);
+    } else if (this->type == Type::Number || this->isBlank()) {
+        this->type = Type::Number;
         this->numberVal = i;
-    } else if (this->isBlank()) {
-        this->numberVal = i;
-        this->iNumber = true;
     }
 }
 
 void JSON::operator=(bool b) {
-    if (this->iBool) {
-        this->boolVal = b;
-    } else if (this->isBlank()) {
+    if (this->type == Type::Bool || this->isBlank()) {
+        this->type = Type::Bool;
         this->boolVal = b;
-        this->iBool = true;
     }
 }
 
 void JSON::operator=(const std::vector<JSON> &value) {
-    if (this->isBlank()) {
-        this->makeArray();
-    } else {
-        this->iString = false;
-        this->iObject = false;
-        this->iNumber = false;
+    if (this->type != Type::Array) {
+        this->reset(Type::Array);
     }
-    this->arrayEls.insert(std::end(this->arrayEls), std::begin(value), std::end(value));
+    auto &els = this->mutableData().arrayEls;
+    els.insert(std::end(els), std::begin(value), std::end(value));
 }
 
 std::string JSON::getString() const {
-    if (this->iString) {
-        return this->stringVal;
+    if (this->type == Type::String && this->payload->stringWriter) {
+        std::string value;
+        JSONStringSink sink(value);
+        this->payload->stringWriter(sink);
+        return value;
+    }
+    if (this->type == Type::String && this->payload->raw != nullptr) {
+        std::string value;
+        value.reserve(this->payload->rawLength);
+        appendUnescaped(value, this->payload->raw, this->payload->raw + this->payload->rawLength);
+        return value;
+    }
+    if (this->type == Type::String) {
+        return std::string(this->payload->stringVal.data(), this->payload->stringVal.size());
     }
     return nullptr;
 }
 
 double JSON::getNumber() const {
-    if (this->iNumber) {
+    if (this->type == Type::Number) {
         return this->numberVal;
     }
     return 0;
 }
 
 bool JSON::getBool() const {
-    if (this->iBool) {
+    if (this->type == Type::Bool) {
         return this->boolVal;
     }
     return false;
 }
 
 std::string JSON::stringify() const {
-    std::stringstream ss;
-    if (this->iArray) {
-        ss << '[';
-        for (unsigned int i = 0; i < this->arrayEls.size(); i++) {
-            ss << this->arrayEls[i].stringify();
-            if (i < this->arrayEls.size() - 1) {
-                ss << ',';
+    std::string out;
+    JSONStringSink sink(out);
+    this->write(sink);
+    return out;
+};
+
+// Write this value and everything under it to sink in a single traversal, without building any intermediate strings
+void JSON::write(JSONSink &sink) const {
+    switch (this->type) {
+        case Type::Array: {
+            sink.write('[');
+            const auto &els = this->data().arrayEls;
+            for (unsigned int i = 0; i < els.size(); i++) {
+                if (i > 0) {
+                    sink.write(',');
+                }
+                els[i].write(sink);
             }
+            sink.write(']');
+            break;
         }
-        ss << ']';
-    } else if (this->iObject) {
-        ss << '{';
-        unsigned int i = 0;
-        for (std::map<std::string, JSON>::const_iterator it = this->objectEls.begin();
-             it != this->objectEls.end(); ++it) {
-            ss << '"' << it->first << '"' << ':' << this->objectEls.at(it->first).stringify();
-            if (i++ < this->objectEls.size() - 1) {
-                ss << ',';
+        case Type::Object: {
+            sink.write('{');
+            bool first = true;
+            for (const auto &element : this->data().objectEls) {
+                if (!first) {
+                    sink.write(',');
+                }
+                first = false;
+                sink.write('"');
+                writeEscaped(sink, element.first.data(), element.first.size());
+                sink.write("\":", 2);
+                element.second.write(sink);
             }
+            sink.write('}');
+            break;
         }
-        ss << '}';
-    } else if (this->iNumber) {
-        ss << this->numberVal;
-    } else if (this->iString) {
-        ss << '"' << this->getEscapedString() << '"';
-    } else if (this->iBool) {
-        if (this->boolVal) {
-            ss << "true";
-        } else {
-            ss << "false";
+        case Type::Number: {
+            // Same format as streaming a double with the default precision
+            char number[32];
+            int length = snprintf(number, sizeof(number), "%g", this->numberVal);
+            sink.write(number, static_cast<size_t>(length));
+            break;
         }
-    } else if (this->null) {
-        ss << "null";
+        case Type::String:
+            sink.write('"');
+            if (this->payload->stringWriter) {
+                this->payload->stringWriter(sink);
+            } else if (this->payload->raw != nullptr &&
+                       memchr(this->payload->raw, '\\', this->payload->rawLength) == nullptr) {
+                // Without escapes the text is exactly what would be written anyway
+                sink.write(this->payload->raw, this->payload->rawLength);
+            } else if (this->payload->raw != nullptr) {
+                std::string value = this->getString();
+                writeEscaped(sink, value.data(), value.size());
+            } else {
+                writeEscaped(sink, this->payload->stringVal.data(), this->payload->stringVal.size());
+            }
+            sink.write('"');
+            break;
+        case Type::Bool:
+            if (this->boolVal) {
+                sink.write("true", 4);
+            } else {
+                sink.write("false", 5);
+            }
+            break;
+        case Type::Null:
+            sink.write("null", 4);
+            break;
+        default:
+            break;
     }
-    return ss.str();
-};
+}
 
 void JSON::makeArray() {
     if (!this->isBlank()) {
         throw std::domain_error("Can only apply makeArray() to blank objects!");
     }
-    this->iArray = true;
+    this->reset(Type::Array);
 }
 
 void JSON::makeNull() {
     if (!this->isBlank()) {
         throw std::domain_error("Can only apply makeNull() to blank objects!");
     }
-    this->null = true;
+    this->reset(Type::Null);
 }
 
 void JSON::makeObject() {
     if (!this->isBlank()) {
         throw std::domain_error("Can only apply makeObject() to blank objects!");
     }
-    this->iObject = true;
+    this->reset(Type::Object);
 }
 
 void JSON::makeBool() {
     if (!this->isBlank()) {
         throw std::domain_error("Can only apply makeBool() to blank objects!");
     }
-    this->iBool = true;
+    this->reset(Type::Bool);
+    this->boolVal = false;
 }
 
 void JSON::push(const JSON &j) {
     if (this->isBlank()) {
         this->makeArray();
     }
-    if (this->iArray) {
-        this->arrayEls.emplace_back(j);
+    if (this->type == Type::Array) {
+        this->mutableData().arrayEls.emplace_back(j);
+    }
+}
+
+void JSON::push(JSON &&j) {
+    if (this->isBlank()) {
+        this->makeArray();
+    }
+    if (this->type == Type::Array) {
+        this->mutableData().arrayEls.emplace_back(std::move(j));
     }
 }
 
@@ -248,83 +522,168 @@ void JSON::unshift(const JSON &j) {
     if (this->isBlank()) {
         this->makeArray();
     }
-    if (this->iArray) {
-        this->arrayEls.emplace(this->arrayEls.begin(), j);
+    if (this->type == Type::Array) {
+        auto &els = this->mutableData().arrayEls;
+        els.emplace(els.begin(), j);
     }
 }
 
 unsigned long JSON::getLength() const {
-    if (this->iArray) {
-        return this->arrayEls.size();
+    if (this->type == Type::Array) {
+        return this->data().arrayEls.size();
     }
-    if (this->iObject) {
-        return this->objectEls.size();
+    if (this->type == Type::Object) {
+        return this->data().objectEls.size();
     }
-    if (this->iString) {
-        return this->stringVal.size();
+    if (this->type == Type::String) {
+        if (this->payload->stringWriter || this->payload->raw != nullptr) {
+            return this->getString().size();
+        }
+        return this->payload->stringVal.size();
     }
 
     return 0;
 }
 
-void JSON::parse() {
-    std::string s = this->origString;
-    s = this->trim(s);
-    this->origString = s;
+/*
+ * The parser makes a single pass over the text with a cursor, building each value in place as it goes. Anything that
+ * isn't valid JSON throws std::invalid_argument.
+ */
+void JSON::parse(const std::string &s, const std::shared_ptr<JSONArena> &arena, bool lazy) {
+    Cursor c{s.data(), s.data() + s.size(), 0, arena, lazy};
+    skipWhitespace(c);
+    this->parseValue(c);
+    skipWhitespace(c);
+    if (c.pos != c.end) {
+        throw std::invalid_argument("Unexpected characters after JSON value");
+    }
+}
 
-    if (s[0] == '[' && s.back() == ']') {
-        this->iArray = true;
-        parseArray();
-    } else if (s[0] == '{' && s.back() == '}') {
-        this->iObject = true;
-        parseObject();
-    } else {
-        if (s[0] == '"' && s.back() == '"') {
-            this->iString = true;
-            // Remove quotes
-            std::string st = s.substr(1, s.length() - 2);
-
-            bool isEscaping = false;
-            // Initialize blank string
-            this->stringVal = std::string();
-            for (char c : st) {
-                if (c == '\\') {
-                    isEscaping = !isEscaping;
-                    continue;
-                }
-                if (isEscaping) {
-                    if (c == 'u') {
-                        this->stringVal += '\\';
-                        this->stringVal += c;
-                    } else {
-                        this->stringVal = JSON::doUnescape(this->stringVal, c);
-                    }
-
-                    isEscaping = false;
-                    continue;
-                }
+void JSON::skipWhitespace(Cursor &c) {
+    while (c.pos != c.end && isspace(static_cast<unsigned char>(*c.pos))) {
+        c.pos++;
+    }
+}
 
-                this->stringVal += c;
-            }
-        } else {
-            if (s == "true") {
-                this->iBool = true;
-                this->boolVal = true;
-            } else if (s == "false") {
-                this->iBool = true;
-                this->boolVal = false;
-            } else if (s == "null") {
-                this->null = true;
+void JSON::parseValue(Cursor &c) {
+    if (c.pos == c.end) {
+        throw std::invalid_argument("Expected a JSON value");
+    }
+
+    switch (*c.pos) {
+        case '[':
+            this->reset(Type::Array, c.arena);
+            parseArray(c);
+            return;
+        case '{':
+            this->reset(Type::Object, c.arena);
+            parseObject(c);
+            return;
+        case '"':
+            this->reset(Type::String, c.arena);
+            if (c.lazy) {
+                const char *start = c.pos + 1;
+                this->payload->raw = start;
+                this->payload->rawLength = findStringEnd(c) - start;
+                c.pos++;  // skip the closing quote
             } else {
-                this->iNumber = true;
-                this->numberVal = std::stod(s);
+                parseString(c, this->payload->stringVal);
             }
+            return;
+        default:
+            break;
+    }
+
+    // A literal or a number runs until the next delimiter
+    const char *start = c.pos;
+    while (c.pos != c.end && *c.pos != ',' && *c.pos != ']' && *c.pos != '}' &&
+           !isspace(static_cast<unsigned char>(*c.pos))) {
+        c.pos++;
+    }
+    std::string token(start, c.pos);
+    if (token == "true") {
+        this->type = Type::Bool;
+        this->boolVal = true;
+    } else if (token == "false") {
+        this->type = Type::Bool;
+        this->boolVal = false;
+    } else if (token == "null") {
+        this->type = Type::Null;
+    } else {
+        size_t used = 0;
+        double number = std::stod(token, &used);  // throws std::invalid_argument if it isn't a number
+        if (used != token.size()) {
+            throw std::invalid_argument("Invalid JSON number: " + token);
         }
+        this->type = Type::Number;
+        this->numberVal = number;
     }
-};
+}
+
+// Parse a quoted string starting at the cursor into out
+template<typename String>
+void JSON::parseString(Cursor &c, String &out) {
+    const char *start = c.pos + 1;
+    const char *end = findStringEnd(c);
+    out.reserve(out.size() + (end - start));  // unescaping only ever shrinks it
+    appendUnescaped(out, start, end);
+    c.pos++;  // skip the closing quote
+}
+
+// Move the cursor from the opening quote of a string to its closing quote, which is returned
+const char *JSON::findStringEnd(Cursor &c) {
+    const char *start = c.pos + 1;
+    const char *quote = start;
+    while (true) {
+        quote = static_cast<const char *>(memchr(quote, '"', c.end - quote));
+        if (quote == nullptr) {
+            throw std::invalid_argument("Unterminated JSON string");
+        }
+        // The quote is escaped if there are an odd number of backslashes right before it
+        const char *backslashes = quote;
+        while (backslashes != start && backslashes[-1] == '\\') {
+            backslashes--;
+        }
+        if ((quote - backslashes) % 2 == 0) {
+            c.pos = quote;
+            return quote;
+        }
+        quote++;
+    }
+}
+
+/*
+ * Append the characters in [begin, end) to out, replacing escape sequences. Unicode escapes are kept as they are, to
+ * be converted by getStringWithUnicode(). Runs without escapes, like base64 data, are appended all at once.
+ */
+template<typename String>
+void JSON::appendUnescaped(String &out, const char *begin, const char *end) {
+    const char *p = begin;
+    while (p != end) {
+        const char *escape = static_cast<const char *>(memchr(p, '\\', end - p));
+        if (escape == nullptr) {
+            out.append(p, end);
+            return;
+        }
+        out.append(p, escape);
+        if (escape + 1 == end) {
+            return;
+        }
+        char c = escape[1];
+        if (c == 'u') {
+            out += '\\';
+            out += c;
+        } else if (c == '\\') {
+            out += '\\';
+        } else {
+            JSON::doUnescape(out, c);
+        }
+        p = escape + 2;
+    }
+}
 
 std::string JSON::getStringWithUnicode() const {
-    if (!this->iString) {
+    if (this->type != Type::String) {
         return nullptr;
     }
 
@@ -333,7 +692,7 @@ std::string JSON::getStringWithUnicode() const {
     int unicodeCount = 0;
     // Initialize blank string
     std::string newString = std::string();
-    for (char c : this->stringVal) {
+    for (char c : this->getString()) {
         if (c == '\\') {
             isEscaping = !isEscaping;
             continue;
@@ -345,7 +704,7 @@ std::string JSON::getStringWithUnicode() const {
                 newString += '\\';
                 newString += c;
             } else {
-                newString = JSON::doUnescape(newString, c);
+                JSON::doUnescape(newString, c);
             }
 
             isEscaping = false;
@@ -418,261 +777,169 @@ std::string JSON::convertToUnicode(const std::string &s) {
     return ret;
 }
 
-void JSON::parseArray() {
-    std::string s = this->origString;
-    bool empty = true;
+// Deeper nesting than this is rejected rather than risk running out of stack
+const unsigned int MAX_JSON_DEPTH = 512;
 
-    int arrayLevel = -1;
-    int objectLevel = 0;
-    bool isEscaping = false;
-    bool quotes = false;
-    std::string singleElement;
-    for (char c : s) {
-        if (c == '\\') {
-            isEscaping = !isEscaping;
-            continue;
-        }
+void JSON::parseArray(Cursor &c) {
+    if (++c.depth > MAX_JSON_DEPTH) {
+        throw std::invalid_argument("JSON is nested too deeply");
+    }
+    c.pos++;  // skip '['
 
-        // Track usage of quotes
-        if (c == '"' && !isEscaping) {
-            quotes = !quotes;
-            singleElement += c;
-            continue;
+    while (true) {
+        skipWhitespace(c);
+        if (c.pos == c.end) {
+            throw std::invalid_argument("Unterminated JSON array");
         }
-
-        // Keep escapes that aren't escaping quotes
-        if (isEscaping) {
-            singleElement += '\\';
+        if (*c.pos == ']') {
+            c.pos++;
+            c.depth--;
+            return;
         }
-
-        // Count sub objects so that they are interpreted as values and not flattened
-        if (!quotes && c == '{') {
-            objectLevel++;
-        } else if (!quotes && c == '}') {
-            objectLevel--;
-        }
-
-        // Current array ended, push values to vector and reset
-        if (!quotes && arrayLevel == 0 && c == ']' && objectLevel <= 0) {
-            arrayLevel--;
-            if (!empty) {
-                this->arrayEls.push_back(JSON(singleElement));
-            }
-            singleElement = std::string();
-        } else if (!quotes && arrayLevel == -1 && c == '[') {
-            arrayLevel++;
-        } else if (!quotes && c == ']') {
-            arrayLevel--;
-            singleElement += c;
-        } else if (!quotes && c == '[') {
-            arrayLevel++;
-            singleElement += c;
-        }
-            // Separate elements by comma
-        else if (!quotes && arrayLevel <= 0 && c == ',' && objectLevel <= 0) {
-            if (!empty) {
-                this->arrayEls.push_back(JSON(singleElement));
-            }
-            singleElement = std::string();
-        } else if (quotes || !isspace(c)) {
-            singleElement += c;
+        // Empty elements are skipped, as they always have been; older servers send listResponses like [,{...}]
+        if (*c.pos == ',') {
+            c.pos++;
+            continue;
         }
 
-        if (singleElement.size() > 0) {
-            empty = false;
+        // Each element is parsed straight into its place in the array
+        auto &els = this->payload->arrayEls;
+        els.emplace_back();
+        els.back().parseValue(c);
+        skipWhitespace(c);
+        if (c.pos != c.end && *c.pos != ',' && *c.pos != ']') {
+            throw std::invalid_argument("Expected ',' or ']' in JSON array");
         }
-
-        isEscaping = false;
     }
 };
 
-std::string JSON::doUnescape(const std::string &s, char c) {
-    std::string ret = s;
+// Append the character that c stands for when escaped to s
+template<typename String>
+void JSON::doUnescape(String &s, char c) {
     if (c == 't') {
-        ret += '\t';
+        s += '\t';
     } else if (c == 'n') {
-        ret += '\n';
+        s += '\n';
     } else if (c == '/') {
-        ret += '/';
+        s += '/';
     } else if (c == 'b') {
-        ret += '\b';
+        s += '\b';
     } else if (c == 'f') {
-        ret += '\f';
+        s += '\f';
     } else if (c == 'r') {
-        ret += '\r';
+        s += '\r';
     } else if (c == '"') {
-        ret += '"';
+        s += '"';
     }
-
-    return ret;
 }
 
-void JSON::parseObject() {
-    std::string s = this->origString;
-    bool empty = true;
-
-    bool quotes = false;
-    bool isEscaping = false;
-    bool isKey = true;
-    int objectLevel = -1;
-    int arrayLevel = 0;
+void JSON::parseObject(Cursor &c) {
+    if (++c.depth > MAX_JSON_DEPTH) {
+        throw std::invalid_argument("JSON is nested too deeply");
+    }
+    c.pos++;  // skip '{'
+    skipWhitespace(c);
+    if (c.pos != c.end && *c.pos == '}') {
+        c.pos++;
+        c.depth--;
+        return;
+    }
 
-    std::string element;
     std::string key;
-    for (char c : s) {
-        // Track quote usage
-        if (c == '"' && !isEscaping) {
-            quotes = !quotes;
-            if (isKey) {
-                key += c;
-            } else {
-                element += c;
-            }
-            continue;
+    while (true) {
+        if (c.pos == c.end || *c.pos != '"') {
+            throw std::invalid_argument("Expected a key in JSON object");
         }
-
-        if (c == '\\') {
-            isEscaping = !isEscaping;
-            continue;
-        }
-
-        // Keep escapes that aren't escaping quotes
-        if (isEscaping) {
-            if (isKey) {
-                key += '\\';
-            } else {
-                element += '\\';
-            }
-        }
-
-        // Count sub objects so that they are interpreted as values and not flattened
-        if (!quotes && c == '{') {
-            objectLevel++;
-        } else if (!quotes && c == '}') {
-            objectLevel--;
-        }
-
-        if (!quotes && c == '[') {
-            arrayLevel++;
-        } else if (!quotes && c == ']') {
-            arrayLevel--;
+        key.clear();
+        parseString(c, key);
+        skipWhitespace(c);
+        if (c.pos == c.end || *c.pos != ':') {
+            throw std::invalid_argument("Expected ':' in JSON object");
         }
+        c.pos++;
+        skipWhitespace(c);
 
-        // Switch from reading the key into reading the value
-        if (!quotes && isKey && c == ':') {
-            isKey = false;
-            continue;
+        // The value is parsed straight into the map. If the key is repeated the first value is kept.
+        auto inserted = this->payload->objectEls.emplace(key, JSON());
+        if (inserted.second) {
+            inserted.first->second.parseValue(c);
+        } else {
+            JSON().parseValue(c);
         }
+        skipWhitespace(c);
 
-        // Start new key:value pair
-        if (!quotes && c == ',' && objectLevel <= 0 && arrayLevel <= 0) {
-            isKey = true;
-            this->objectEls.emplace(JSON(key).getString(), JSON(element));
-            key = std::string();
-            element = std::string();
+        if (c.pos == c.end) {
+            throw std::invalid_argument("Unterminated JSON object");
         }
-
-        // Write into key
-        if (isKey) {
-            if (quotes && c != '{') {
-                key += c;
-            }
-        } else if (!quotes && objectLevel < 0 && c == '}') {
-            continue;
+        if (*c.pos == '}') {
+            c.pos++;
+            c.depth--;
+            return;
         }
-            // Write into value
-        else {
-            empty = false;
-            element += c;
+        if (*c.pos != ',') {
+            throw std::invalid_argument("Expected ',' or '}' in JSON object");
         }
-
-        isEscaping = false;
-    }
-
-    if (!empty) {
-        // Add last element (no comma to break loop as in other values)
-        this->objectEls.emplace(JSON(key).getString(), JSON(element));
+        c.pos++;
+        skipWhitespace(c);
     }
 };
 
-std::vector<JSON>::const_iterator JSON::begin() const {
-    if (this->iArray) {
-        return this->arrayEls.begin();
-    }
-    return this->arrayEls.end();;
+JSON::const_iterator JSON::begin() const {
+    return this->data().arrayEls.data();
 }
 
-std::vector<JSON>::const_iterator JSON::end() const {
-    if (this->iArray) {
-        return this->arrayEls.end();
-    }
-    return this->arrayEls.end();
+JSON::const_iterator JSON::end() const {
+    return this->data().arrayEls.data() + this->data().arrayEls.size();
 }
 
 std::string JSON::getEscapedString() const {
-    if (this->iString) {
-        std::stringstream ss;
-        for (size_t i = 0; i < this->stringVal.size(); i++) {
-            char codepoint = this->stringVal[i];
-            switch (codepoint) {
-                case 0x08: {
-                    ss << '\\';
-                    ss << 'b';
-                    break;
-                }
-                case 0x09: {
-                    ss << '\\';
-                    ss << 't';
-                    break;
-                }
-                case 0x0A: {
-                    ss << '\\';
-                    ss << 'n';
-                    break;
-                }
-                case 0x0C: {
-                    ss << '\\';
-                    ss << 'f';
-                    break;
-                }
-                case 0x0D: {
-                    ss << '\\';
-                    ss << 'r';
-                    break;
-                }
-                case 0x22: {
-                    ss << '\\';
-                    ss << '\"';
-                    break;
-                }
-                case 0x5C: {
-                    ss << '\\';
-                    if (this->stringVal[i + 1] != 'u') {
-                        ss << '\\';
-                    }
-                    break;
-                }
-                default:
-                    ss << codepoint;
-                    break;
-            }
-        }
-        return ss.str();
+    if (this->type == Type::String) {
+        std::string out;
+        JSONStringSink sink(out);
+        std::string value = this->getString();
+        writeEscaped(sink, value.data(), value.size());
+        return out;
     }
     return std::string();
 }
 
-void JSON::operator=(const JSON &s) {
-    this->arrayEls = s.arrayEls;
-    this->objectEls = s.objectEls;
-    this->stringVal = s.stringVal;
-    this->numberVal = s.numberVal;
-    this->boolVal = s.boolVal;
-    this->origString = s.origString;
-    this->iObject = s.iObject;
-    this->iBool = s.iBool;
-    this->null = s.null;
-    this->iArray = s.iArray;
-    this->iString = s.iString;
-    this->iNumber = s.iNumber;
+// Write s with the characters that JSON doesn't allow in strings escaped. Unicode escapes are already escaped.
+void JSON::writeEscaped(JSONSink &sink, const char *s, size_t length) {
+    size_t runStart = 0;
+    for (size_t i = 0; i < length; i++) {
+        char escaped;
+        switch (s[i]) {
+            case 0x08:
+                escaped = 'b';
+                break;
+            case 0x09:
+                escaped = 't';
+                break;
+            case 0x0A:
+                escaped = 'n';
+                break;
+            case 0x0C:
+                escaped = 'f';
+                break;
+            case 0x0D:
+                escaped = 'r';
+                break;
+            case 0x22:
+                escaped = '"';
+                break;
+            case 0x5C:
+                escaped = (i + 1 < length && s[i + 1] == 'u') ? '\0' : '\\';
+                break;
+            default:
+                continue;
+        }
+        // Everything since the last escape goes out in one piece
+        sink.write(s + runStart, i - runStart);
+        sink.write('\\');
+        if (escaped != '\0') {
+            sink.write(escaped);
+        }
+        runStart = i + 1;
+    }
+    sink.write(s + runStart, length - runStart);
 }
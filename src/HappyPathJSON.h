@@ -1,29 +1,114 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
 #include <algorithm>
 #include <cstdio>
+#include <functional>
+#include <memory>
 
 #ifndef MYJSON_H
 #define MYJSON_H
 
+// Destination for JSON.write(). Output arrives in pieces, in order.
+class JSONSink {
+public:
+    virtual ~JSONSink() = default;
+
+    virtual void write(const char *data, size_t length) = 0;
+
+    void write(char c) { this->write(&c, 1); }
+
+    void write(const std::string &s) { this->write(s.data(), s.size()); }
+};
+
+// Appends everything to a string
+class JSONStringSink : public JSONSink {
+public:
+    explicit JSONStringSink(std::string &out) : out(out) {}
+
+    void write(const char *data, size_t length) override { this->out.append(data, length); }
+
+    using JSONSink::write;
+
+private:
+    std::string &out;
+};
+
+/*
+ * Bump allocator for the nodes and strings of one parsed document. Memory is handed out from large blocks and only
+ * given back, all at once, when the last value allocated from the arena is destroyed. Not thread safe, so a document
+ * parsed into an arena should only be changed from one thread at a time.
+ */
+class JSONArena {
+public:
+    explicit JSONArena(size_t blockSize = 64 * 1024);
+
+    JSONArena(const JSONArena &) = delete;
+
+    JSONArena &operator=(const JSONArena &) = delete;
+
+    ~JSONArena();
+
+    void *allocate(size_t bytes, size_t alignment);
+
+    size_t bytesAllocated() const { return this->allocated; };
+
+    // Hold on to text for as long as the arena lives, for values that point into it
+    const std::string &keep(std::string text);
+
+private:
+    std::vector<void *> blocks;
+    std::deque<std::string> texts;
+    char *pos;
+    char *end;
+    size_t blockSize;
+    size_t allocated;
+};
+
+/*
+ * A JSON value is a type tag, a number or bool stored inline, and a pointer to the string, array or object data.
+ * That data is shared by copies of the value and only copied when one of them is changed, so copying a message or
+ * part of one costs a reference count rather than a copy of everything under it.
+ */
 class JSON {
 public:
+    // Writes the contents of a string value on demand; they're written as they are, so must not need escaping
+    typedef std::function<void(JSONSink &)> StringWriter;
+
+    typedef const JSON *const_iterator;
+
     explicit JSON(const std::string &j);
 
-    JSON() = default;
+    JSON() : type(Type::Blank), numberVal(0) {};
+
+    JSON(const JSON &j);
+
+    JSON(JSON &&j) noexcept;
 
     explicit JSON(double i);
 
-    explicit JSON(std::map<std::string, JSON> &m);
+    explicit JSON(std::map<std::string, JSON> m);
 
-    explicit JSON(std::vector<JSON> &js);
+    explicit JSON(std::vector<JSON> js);
 
     JSON(const std::string &j, bool plainString);
 
+    explicit JSON(const StringWriter &stringWriter);
+
+    // Parse j, allocating every node and string of the document from arena
+    JSON(const std::string &j, const std::shared_ptr<JSONArena> &arena);
+
+    /*
+     * Parse j into arena as a view of the text, which the arena keeps. The structure is indexed up front, but strings
+     * are left as they appear in the text and only unescaped when they're read, so large values that are never looked
+     * at cost no more than finding where they end.
+     */
+    static JSON view(std::string j, const std::shared_ptr<JSONArena> &arena);
+
     bool hasKey(const std::string &k) const;
 
     JSON &operator[](unsigned int i);
@@ -34,7 +119,9 @@ public:
 
     const JSON &operator[](const std::string &s) const;
 
-    void operator=(const JSON &j);
+    JSON &operator=(const JSON &j);
+
+    JSON &operator=(JSON &&j) noexcept;
 
     void operator=(const std::string &s);
 
@@ -44,74 +131,27 @@ public:
 
     void operator=(const std::vector<JSON> &value);
 
-    bool operator==(const JSON &rhs) const {
-        if (iArray && rhs.iArray) {
-            if (arrayEls.size() != rhs.arrayEls.size()) {
-                return false;
-            }
-
-            for (unsigned int i = 0; i < arrayEls.size(); i++) {
-                if (arrayEls[i] != rhs.arrayEls[i]) {
-                    return false;
-                }
-            }
-            return true;
-        } else if (iObject && rhs.iObject) {
-            if (objectEls.size() != rhs.objectEls.size()) {
-                return false;
-            }
-            for (std::map<std::string, JSON>::const_iterator it = objectEls.begin();
-                 it != objectEls.end(); ++it) {
-                if (rhs.objectEls.find(it->first) == rhs.objectEls.end()) {
-                    return false;
-                }
-                if (rhs.objectEls.at(it->first) != it->second) {
-                    return false;
-                }
-            }
-            return true;
-        } else if (iBool && rhs.iBool) {
-            return boolVal == rhs.boolVal;
-        } else if (null && rhs.null) {
-            return true;
-        } else if (iString && rhs.iString) {
-            return stringVal == rhs.stringVal;
-        } else if (iNumber && rhs.iNumber) {
-            return numberVal == rhs.numberVal;
-        }
-
-        return false;
-    }
+    bool operator==(const JSON &rhs) const;
 
     bool operator!=(const JSON &rhs) const {
         return !(rhs == *this);
     }
 
-    bool isObject() const { return this->iObject; };
+    bool isObject() const { return this->type == Type::Object; };
 
-    bool isArray() const { return this->iArray; };
+    bool isArray() const { return this->type == Type::Array; };
 
-    ssize_t size() const {
-        if (this->iArray) {
-            return this->arrayEls.size();
-        } else if (this->isObject()) {
-            return this->objectEls.size();
-        } else {
-            return -1;
-        }
-    }
+    ssize_t size() const;
 
-    bool isNumber() const { return this->iNumber; };
+    bool isNumber() const { return this->type == Type::Number; };
 
-    bool isString() const { return this->iString; };
+    bool isString() const { return this->type == Type::String; };
 
-    bool isBool() const { return this->iBool; };
+    bool isBool() const { return this->type == Type::Bool; };
 
-    bool isNull() const { return this->null; };
+    bool isNull() const { return this->type == Type::Null; };
 
-    bool isBlank() const {
-        return !(this->iArray || this->iObject || this->iNumber || this->iString || this->null || this->iBool);
-    };
+    bool isBlank() const { return this->type == Type::Blank; };
 
     friend std::ostream &operator<<(std::ostream &os, const JSON &j) {
         os << j.stringify();
@@ -120,6 +160,8 @@ public:
 
     std::string stringify() const;
 
+    void write(JSONSink &sink) const;
+
     void makeArray();
 
     void makeObject();
@@ -130,6 +172,8 @@ public:
 
     void push(const JSON &j);
 
+    void push(JSON &&j);
+
     void unshift(const JSON &j);
 
     unsigned long getLength() const;
@@ -140,41 +184,75 @@ public:
 
     bool getBool() const;
 
-    std::vector<JSON>::const_iterator begin() const;
+    const_iterator begin() const;
 
-    std::vector<JSON>::const_iterator end() const;
+    const_iterator end() const;
 
     std::string getEscapedString() const;
 
     std::string getStringWithUnicode() const;
 
 private:
-    static std::string trim(const std::string &);
+    enum class Type : unsigned char {
+        Blank, Null, Bool, Number, String, Array, Object
+    };
+
+    // String, array and object data, shared between copies
+    struct Payload;
+
+    // Position in the text being parsed. Values are built straight from it, without copying out substrings.
+    struct Cursor {
+        const char *pos;
+        const char *end;
+        unsigned int depth;
+        std::shared_ptr<JSONArena> arena;  // where new values are allocated, if anywhere
+        bool lazy;  // leave strings pointing into the text, which must live as long as the arena
+    };
+
+    void reset(Type t, const std::shared_ptr<JSONArena> &arena = std::shared_ptr<JSONArena>());
+
+    void copyScalar(const JSON &j);
+
+    const Payload &data() const;
+
+    Payload &mutableData();
+
+    Payload &mutableDataForReference();
+
+    void parse(const std::string &s, const std::shared_ptr<JSONArena> &arena = std::shared_ptr<JSONArena>(),
+               bool lazy = false);
 
-    void parse();
+    void parseValue(Cursor &c);
 
-    void parseArray();
+    void parseArray(Cursor &c);
 
-    void parseObject();
+    void parseObject(Cursor &c);
 
-    static std::string doUnescape(const std::string &s, char c);
+    template<typename String>
+    static void parseString(Cursor &c, String &out);
+
+    static const char *findStringEnd(Cursor &c);
+
+    static void skipWhitespace(Cursor &c);
+
+    template<typename String>
+    static void appendUnescaped(String &out, const char *begin, const char *end);
+
+    template<typename String>
+    static void doUnescape(String &s, char c);
+
+    static void writeEscaped(JSONSink &sink, const char *s, size_t length);
 
     static std::string convertToUnicode(const std::string &s);
 
     static bool isNumeric(const std::string &s);
 
-    std::vector<JSON> arrayEls;
-    std::map<std::string, JSON> objectEls;
-    std::string stringVal;
-    double numberVal;
-    bool boolVal;
-    std::string origString;
-    bool iObject = false;
-    bool iBool = false;
-    bool null = false;
-    bool iArray = false;
-    bool iString = false;
-    bool iNumber = false;
+    Type type;
+    union {
+        double numberVal;
+        bool boolVal;
+    };
+    std::shared_ptr<Payload> payload;  // only set for strings, arrays and objects
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include "Project4Common.h"
+#include <thread>
 
 using std::string;
 using std::vector;
@@ -14,7 +15,21 @@ using std::set;
 using std::map;
 
 int sock;
+SocketReader *sockReader = nullptr;
 string directory = ".";
+double protocolVersion = VERSION;  // the highest version the server has said it understands
+unsigned int nextRequestId = 1;
+
+/*
+ * The server's listing as of the last time it was asked for. A server that journals changes to its listing says which
+ * generation of the journal the listing is from, and after that only what changed since needs asking for.
+ */
+struct ServerListing {
+    string journal;  // empty if the server has no journal
+    double generation = 0;
+    map<string, string> files;  // filename to checksum
+};
+ServerListing serverListing;
 
 void printHelp(char **argv) {
     cout << "Usage: " << *argv << " -p portNumber -s serverHostOrIP [-d directory]" << endl;
@@ -47,17 +62,42 @@ int createTCPSocketAndConnect(const string &host, unsigned short serverPort) {
 void sendLeave(int sock) {
     json leavePacket;
 
-    leavePacket["version"] = VERSION;
+    leavePacket["version"] = protocolVersion;
     leavePacket["type"] = std::string("leave");
     sendToSocket(sock, leavePacket);
 }
 
-void sendListRequest(int sock) {
+// Ask for the page of the listing after the given filename, or for its first page if that's empty
+void sendListRequest(int sock, const string &after) {
     json listRequestPacket;
 
-    listRequestPacket["version"] = VERSION;
+    listRequestPacket["version"] = protocolVersion;
     listRequestPacket["type"] = string("listRequest");
-    sendToSocket(sock, listRequestPacket);
+    if (protocolVersion == VERSION) {
+        // Servers that can frame their listResponse will do so, so even the first listing is never scanned for '\n'
+        listRequestPacket["maxVersion"] = LIST_SINCE_VERSION;
+    }
+    // Servers that can't send the listing in pages ignore these and send all of it
+    listRequestPacket["limit"] = static_cast<double>(LIST_PAGE_SIZE);
+    if (!after.empty()) {
+        listRequestPacket["after"] = JSON(after, true);
+    }
+    if (!sendToSocket(sock, listRequestPacket)) {
+        exit(1);
+    }
+}
+
+// Ask for what changed in the server's listing since the generation serverListing is from
+void sendListSinceRequest(int sock) {
+    json listSinceRequestPacket;
+
+    listSinceRequestPacket["version"] = protocolVersion;
+    listSinceRequestPacket["type"] = string("listSinceRequest");
+    listSinceRequestPacket["journal"] = JSON(serverListing.journal, true);
+    listSinceRequestPacket["generation"] = serverListing.generation;
+    if (!sendToSocket(sock, listSinceRequestPacket)) {
+        exit(1);
+    }
 }
 
 void handleLeave(int sock) {
@@ -66,33 +106,106 @@ void handleLeave(int sock) {
 }
 
 json receiveResponse(int sock) {
-    auto answer = receiveUntilByteEquals(sock, '\n');
-    json answerJ = json(answer);
-    return answerJ;
+    return receiveMessage(*sockReader);
 }
 
-json doList(int sock) {
-    sendListRequest(sock);
-    json answerJ = receiveResponse(sock);
-    return answerJ;
+// Receive a listResponse and settle the protocol version from it. Returns false if the server answered anything else.
+bool receiveListResponse(int sock, json &answerJ) {
+    answerJ = receiveResponse(sock);
+    if (!verifyJSONPacket(answerJ, "listResponse")) {
+        return false;
+    }
+    protocolVersion = negotiateVersion(answerJ);
+    return true;
 }
 
-void handleList(int sock) {
-    auto answerJ = doList(sock);
-    if (verifyJSONPacket(answerJ, "listResponse")) {
-        auto responses = answerJ["response"];
-        cout << "Server Files Listing:" << endl
-             << "=====================" << endl;
-
-        for (auto file : responses) {
-            if (file.hasKey("filename")) {
-                cout << file["filename"].getString() << endl;
+/*
+ * Get the server's listing and hand each page of it to onPage, starting from firstPage if the server has sent that
+ * already. A server that can send it a page at a time does, and each page is let go of before the next is asked for,
+ * so a large listing is never held as one message. Returns false if the server answers with anything but a
+ * listResponse.
+ */
+bool doList(int sock, const std::function<void(const json &page)> &onPage, json firstPage = json()) {
+    string after;
+    json answerJ = std::move(firstPage);
+    if (answerJ.isBlank()) {
+        sendListRequest(sock, after);
+        if (!receiveListResponse(sock, answerJ)) {
+            return false;
+        }
+    }
+    while (true) {
+        onPage(answerJ);
+        string next = answerJ.hasKey("next") ? answerJ["next"].getString() : string();
+        // Pages come in order of filename, so one that doesn't move on would never end
+        if (next <= after) {
+            return true;
+        }
+        after = next;
+        sendListRequest(sock, after);
+        if (!receiveListResponse(sock, answerJ)) {
+            return false;
+        }
+    }
+}
+
+void addServerFiles(ServerListing &listing, const json &files) {
+    for (const auto &file : files) {
+        if (file.hasKey("checksum") && file.hasKey("filename")) {
+            listing.files[file["filename"].getString()] = file["checksum"].getString();
+        }
+    }
+}
+
+/*
+ * Bring serverListing up to date. Once it has been listed from a server that journals its changes, only the files
+ * changed since are asked for. The whole listing is read instead the first time, from older servers, and whenever
+ * the server can't say what changed.
+ */
+bool listServerFiles(int sock) {
+    json answerJ;
+    if (!serverListing.journal.empty() && protocolVersion >= LIST_SINCE_VERSION) {
+        sendListSinceRequest(sock);
+        if (!receiveListResponse(sock, answerJ)) {
+            serverListing = ServerListing();
+            return false;
+        }
+        if (answerJ.hasKey("since")) {
+            addServerFiles(serverListing, answerJ["response"]);
+            for (const auto &filename : answerJ["removed"]) {
+                serverListing.files.erase(filename.getString());
             }
+            serverListing.generation = answerJ["generation"].getNumber();
+            return true;
         }
-        cout << "=====================" << endl << endl;
-    } else {
+        // Otherwise it's the first page of the whole listing
+    }
+
+    ServerListing listing;
+    bool firstPage = true;
+    bool listed = doList(sock, [&listing, &firstPage](const json &page) {
+        if (firstPage && page.hasKey("journal")) {
+            listing.journal = page["journal"].getString();
+            listing.generation = page["generation"].getNumber();
+        }
+        firstPage = false;
+        addServerFiles(listing, page["response"]);
+    }, std::move(answerJ));
+    serverListing = listed ? std::move(listing) : ServerListing();
+    return listed;
+}
+
+void handleList(int sock) {
+    if (!listServerFiles(sock)) {
         cout << "Bad listResponse" << endl;
+        return;
+    }
+    cout << "Server Files Listing:" << endl
+         << "=====================" << endl;
+    for (const auto &file : serverListing.files) {
+        cout << file.first << endl;
     }
+    cout << "=====================" << endl << endl;
 }
 
 json setToJsonList(const set<string> &values) {
@@ -117,8 +230,8 @@ considerFileConflict(json &diffJSON, const string &filename, const set<string> &
             targetFilenameKey = "clientTargetFilename";
             conflictKey = "serverToClientConflicts";
         }
-        conflict[sourceFilenameKey] = filename;
-        conflict[targetFilenameKey] = filenameIncrement(filename, filenameSet);
+        conflict[sourceFilenameKey] = JSON(filename, true);
+        conflict[targetFilenameKey] = JSON(filenameIncrement(filename, filenameSet), true);
         diffJSON[conflictKey].push(conflict);
     }
 }
@@ -135,7 +248,7 @@ json createDiffJSON(const map<string, set<string> > &clientMap, const set<string
 
         if (serverMap.find(cCsum) != serverMap.end()) {     // if the server also has a file w/that checksum
             json duplB;
-            duplB["checksum"] = cCsum;
+            duplB["checksum"] = JSON(cCsum, true);
             duplB["clientFilenames"] = setToJsonList(cFnames);
             tmpFnames = serverMap.at(cCsum);
             duplB["serverFilenames"] = setToJsonList(tmpFnames);
@@ -143,7 +256,7 @@ json createDiffJSON(const map<string, set<string> > &clientMap, const set<string
             diffJSON["duplicateBothClientServer"].push(duplB);
         } else if (cFnames.size() > 1) {
             json duplC;
-            duplC["checksum"] = cCsum;
+            duplC["checksum"] = JSON(cCsum, true);
             duplC["filenames"] = setToJsonList(cFnames);
             debug("    Found multiple files matching the checksum, only on the client: " + duplC["filenames"].stringify());
             diffJSON["duplicateOnlyClient"].push(duplC);
@@ -152,10 +265,10 @@ json createDiffJSON(const map<string, set<string> > &clientMap, const set<string
             considerFileConflict(diffJSON, firstFname, serverFilenameSet, true);
         } else {                                              // file is unique on client
             json uniqueC;
-            uniqueC["checksum"] = cCsum;
+            uniqueC["checksum"] = JSON(cCsum, true);
             string fname = *(cFnames.begin());
             debug("    Only 1 file matches the checksum, on client: " + fname);
-            uniqueC["filename"] = fname;
+            uniqueC["filename"] = JSON(fname, true);
             diffJSON["uniqueOnlyClient"].push(uniqueC);
             considerFileConflict(diffJSON, fname, serverFilenameSet, true);
         }
@@ -171,7 +284,7 @@ json createDiffJSON(const map<string, set<string> > &clientMap, const set<string
             debug("    Found matching file(s) on client");  // do nothing because we've already handled it
         } else if (sFnames.size() > 1) {
             json duplS;
-            duplS["checksum"] = sCsum;
+            duplS["checksum"] = JSON(sCsum, true);
             duplS["filenames"] = setToJsonList(sFnames);
             debug("    Found multiple files matching the checksum, only on the server: " + duplS["filenames"].stringify());
             diffJSON["duplicateOnlyServer"].push(duplS);
@@ -180,10 +293,10 @@ json createDiffJSON(const map<string, set<string> > &clientMap, const set<string
             considerFileConflict(diffJSON, firstFname, clientFilenameSet, false);
         } else {                                              // file is unique on server
             json uniqueS;
-            uniqueS["checksum"] = sCsum;
+            uniqueS["checksum"] = JSON(sCsum, true);
             string fname = *(sFnames.begin());
             debug("    Only 1 file matches the checksum, on server: " + fname);
-            uniqueS["filename"] = fname;
+            uniqueS["filename"] = JSON(fname, true);
             diffJSON["uniqueOnlyServer"].push(uniqueS);
             considerFileConflict(diffJSON, fname, clientFilenameSet, false);
         }
@@ -191,7 +304,7 @@ json createDiffJSON(const map<string, set<string> > &clientMap, const set<string
     return diffJSON;
 }
 
-json doDiff(json listResponse) {
+json doDiff(const map<string, string> &serverFiles) {
     /* pseudocode:
      *  make a map of checksums to sets of filenames. This facilitates identifying duplicates
      *  make a set of filenames on the client and a set of filenames on the server, to facilitate identifying conflicts
@@ -201,7 +314,6 @@ json doDiff(json listResponse) {
      *  return a json struct of that for further use
      */
 
-    debug("In doDiff(" + listResponse.stringify() + ")");
     map<string, set<string>> clientMap;
     set<string> clientFilenameSet = set<string>();
     auto clientMusicDataList = list(directory);
@@ -226,23 +338,20 @@ json doDiff(json listResponse) {
     map<string, set<string>> serverMap;
     set<string> serverFilenameSet = set<string>();
 
-    auto serverFilesResponse = listResponse["response"];         // Format: [{filename: String, checksum: String}]
     // populate serverMap and serverFilenameSet
-    for (auto file: serverFilesResponse) {
-        if (file.hasKey("checksum") && file.hasKey("filename")) {
-            string sFname = file["filename"].getString();
-            string sCsum = file["checksum"].getString();
-            debug("  Looking at client file " + sFname + " with checksum " + sCsum);
-            serverFilenameSet.insert(sFname); // add filename (guaranteed unique locally) to set
-
-            // If the checksum isn't in the map, then create a new set and map checksum to set
-            if (serverMap.find(sCsum) == serverMap.end()) {
-                set<string> fnames;
-                fnames.insert(sFname);
-                serverMap[sCsum] = fnames;
-            } else {
-                serverMap[sCsum].insert(sFname);
-            }
+    for (const auto &file : serverFiles) {
+        string sFname = file.first;
+        string sCsum = file.second;
+        debug("  Looking at server file " + sFname + " with checksum " + sCsum);
+        serverFilenameSet.insert(sFname); // add filename (guaranteed unique locally) to set
+
+        // If the checksum isn't in the map, then create a new set and map checksum to set
+        if (serverMap.find(sCsum) == serverMap.end()) {
+            set<string> fnames;
+            fnames.insert(sFname);
+            serverMap[sCsum] = fnames;
+        } else {
+            serverMap[sCsum].insert(sFname);
         }
     }
 
@@ -250,29 +359,35 @@ json doDiff(json listResponse) {
     return diffJSON;
 }
 
-json createPushRequestFromDiffJSON(const json &diffStruct) {
+json createPushRequestFromDiffJSON(const json &diffStruct, double version) {
+    // Only version 1 carries file data inside the request; later versions stream it afterwards
+    bool withData = version == VERSION;
     json pushRequest;
-    pushRequest["version"] = VERSION;
+    pushRequest["version"] = version;
     pushRequest["type"] = JSON("pushRequest", true);
     json emptyArr;
     emptyArr.makeArray();
     pushRequest["request"] = emptyArr;
     if (diffStruct.hasKey("uniqueOnlyClient")) {
         for (auto file: diffStruct["uniqueOnlyClient"]) {
-            pushRequest["request"].push(MusicData(directory+(file["filename"].getString())).getAsJSON(true));
+            pushRequest["request"].push(
+                    MusicData(directory + file["filename"].getString(), file["checksum"].getString()).getAsJSON(
+                            withData));
         }
     }
     if (diffStruct.hasKey("duplicateOnlyClient")) {
         for (auto fileish: diffStruct["duplicateOnlyClient"]) {
-            pushRequest["request"].push(MusicData(directory+(fileish["filenames"][0].getString())).getAsJSON(true));
+            pushRequest["request"].push(
+                    MusicData(directory + fileish["filenames"][0].getString(), fileish["checksum"].getString())
+                            .getAsJSON(withData));
         }
     }
     return pushRequest;
 }
 
-json createPullRequestFromDiffJSON(const json &diffStruct) {
+json createPullRequestFromDiffJSON(const json &diffStruct, double version) {
     json pullRequest;
-    pullRequest["version"] = VERSION;
+    pullRequest["version"] = version;
     pullRequest["type"] = JSON("pullRequest", true);
     json emptyArr;
     emptyArr.makeArray();
@@ -294,8 +409,9 @@ json createPullRequestFromDiffJSON(const json &diffStruct) {
 }
 
 void printDiff(const json &diffJSON) {
-    auto pullRequest = createPullRequestFromDiffJSON(diffJSON);
-    auto pushRequest = createPushRequestFromDiffJSON(diffJSON);
+    // Printing only needs filenames, so don't bother reading any file data into the pushRequest
+    auto pullRequest = createPullRequestFromDiffJSON(diffJSON, STREAMING_VERSION);
+    auto pushRequest = createPushRequestFromDiffJSON(diffJSON, STREAMING_VERSION);
 
     debug("  Corresponding pullRequest: " + pullRequest.stringify());
     debug("  Corresponding pushRequest: " + pushRequest.stringify());
@@ -316,13 +432,12 @@ void printDiff(const json &diffJSON) {
 void handleDiff(int sock) {
     cout << "Diff:" << endl;
     cout << "=====================" << endl;
-    auto listResponse = doList(sock);
-    if (!verifyJSONPacket(listResponse, "listResponse")) {
+    if (!listServerFiles(sock)) {
         cout << "Unable to verify listResponse from server!" << endl;
         return;
     }
 
-    auto diffJSON = doDiff(listResponse);
+    auto diffJSON = doDiff(serverListing.files);
     printDiff(diffJSON);
     cout << "=====================" << endl << endl;
 }
@@ -339,21 +454,245 @@ bool isResponseComplete(const json &response, const json &request) {
     return requestedChecksums == receivedChecksums;
 }
 
+/*
+ * Files being pushed that the server has a different file of the same name for can be sent as deltas against that
+ * file. Ask the server for the chunks of each one and name it as the entry's base. Returns the chunks by filename.
+ */
+map<string, vector<Chunk>> requestPushBases(int sock, json &pushRequest, const map<string, string> &serverChecksums) {
+    map<string, vector<Chunk>> bases;
+
+    json manifestRequest;
+    manifestRequest["version"] = pushRequest["version"].getNumber();
+    manifestRequest["type"] = JSON("manifestRequest", true);
+    json emptyArr;
+    emptyArr.makeArray();
+    manifestRequest["request"] = emptyArr;
+    for (auto file : pushRequest["request"]) {
+        auto serverFile = serverChecksums.find(file["filename"].getString());
+        if (serverFile != serverChecksums.end()) {
+            json entry;
+            entry["filename"] = JSON(serverFile->first, true);
+            entry["checksum"] = JSON(serverFile->second, true);
+            manifestRequest["request"].push(std::move(entry));
+        }
+    }
+    if (manifestRequest["request"].getLength() == 0 || !sendToSocket(sock, manifestRequest)) {
+        return bases;
+    }
+
+    json manifestResponse = receiveResponse(sock);
+    if (!verifyJSONPacket(manifestResponse, "manifestResponse")) {
+        return bases;
+    }
+    for (auto entry : manifestResponse["response"]) {
+        if (entry.hasKey("chunks")) {
+            bases[entry["filename"].getString()] = chunksFromJSON(entry["chunks"]);
+        }
+    }
+    json &request = pushRequest["request"];
+    for (unsigned int i = 0; i < request.getLength(); i++) {
+        string filename = request[i]["filename"].getString();
+        if (bases.find(filename) != bases.end()) {
+            request[i]["base"] = JSON(filename, true);
+        }
+    }
+    return bases;
+}
+
+/*
+ * Send the chunks of each local file that shares a name with a file being pulled, so the server can send that file as
+ * a delta against ours. Returns the bases by filename.
+ */
+map<string, DeltaBase> addPullBases(json &pullRequest) {
+    map<string, DeltaBase> bases;
+    json &request = pullRequest["request"];
+    for (unsigned int i = 0; i < request.getLength(); i++) {
+        string filename = request[i]["filename"].getString();
+        DeltaBase base;
+        base.path = directory + filename;
+        if (chunkFile(base.path, base.chunks)) {
+            request[i]["chunks"] = chunksToJSON(base.chunks);
+            bases[filename] = std::move(base);
+        }
+    }
+    return bases;
+}
+
+// A request for a single file, tagged with the next request ID
+json makeFileRequest(const string &type, double version, const json &file) {
+    json request;
+    request["version"] = version;
+    request["type"] = JSON(type, true);
+    request["id"] = static_cast<double>(nextRequestId++);
+    json files;
+    files.makeArray();
+    files.push(file);
+    request["request"] = std::move(files);
+    return request;
+}
+
+/*
+ * Sync with every pull and push as a request of its own, tagged with an ID. A second thread sends the requests, and
+ * the bodies of pushed files, while this one reads the responses as they arrive and writes each pulled file as soon
+ * as its data does. Pulls go first since they're small, so the server has them all queued to send while it receives
+ * the pushed files, and both directions of the connection stay busy.
+ */
+void syncPipelined(int sock, const json &pushRequest, const json &pullRequest,
+                   const map<string, vector<Chunk>> &pushBases, const map<string, DeltaBase> &pullBases) {
+    double version = pushRequest["version"].getNumber();
+    // The sender thread has requests to itself; this one only looks at the filenames and checksums kept here
+    vector<json> requests;
+    map<unsigned int, std::pair<string, string>> inFlight;  // filename and checksum by request ID
+    for (auto file : pullRequest["request"]) {
+        requests.push_back(makeFileRequest("pullRequest", version, file));
+        inFlight[nextRequestId - 1] = {file["filename"].getString(), file["checksum"].getString()};
+    }
+    for (auto file : pushRequest["request"]) {
+        requests.push_back(makeFileRequest("pushRequest", version, file));
+        inFlight[nextRequestId - 1] = {file["filename"].getString(), file["checksum"].getString()};
+    }
+
+    bool compress = version >= COMPRESSION_VERSION;
+    string unsent;  // the file the sender gave up on, if it did
+    std::thread sender([sock, compress, &requests, &pushBases, &unsent] {
+        for (const auto &request : requests) {
+            bool sent = sendToSocket(sock, request);
+            if (sent && request["type"].getString() == "pushRequest") {
+                string filename = request["request"][0]["filename"].getString();
+                auto base = pushBases.find(filename);
+                sent = (base == pushBases.end()) ? sendFileChunks(sock, directory + filename, compress)
+                                                 : sendFileDelta(sock, directory + filename, base->second, compress);
+            }
+            if (!sent) {
+                unsent = request["request"][0]["filename"].getString();
+                // The server is waiting on something it won't get, so there's no carrying on with this connection
+                shutdown(sock, SHUT_RDWR);
+                return;
+            }
+        }
+    });
+
+    set<string> filenames;
+    for (string path : directoryFileListing(directory)) {
+        filenames.insert(getFilename(path));
+    }
+    vector<string> wroteToServer;
+    vector<string> wroteToClient;
+    bool incompletePush = false;
+    bool incompletePull = false;
+    try {
+        while (!inFlight.empty()) {
+            json response = receiveResponse(sock);
+            auto request = response.hasKey("id") ? inFlight.find(static_cast<unsigned int>(response["id"].getNumber()))
+                                                 : inFlight.end();
+            if (!verifyJSONPacket(response) || request == inFlight.end()) {
+                throw std::runtime_error("Bad packet received from server");
+            }
+            string filename = request->second.first;
+            string checksum = request->second.second;
+            inFlight.erase(request);
+
+            const json &files = response["response"];
+            if (verifyJSONPacket(response, "pushResponse")) {
+                if (files.getLength() == 1 && files[0]["checksum"].getString() == checksum) {
+                    wroteToServer.push_back(files[0]["filename"].getString());
+                } else {
+                    incompletePush = true;
+                }
+                continue;
+            }
+            if (!verifyJSONPacket(response, "pullResponse")) {
+                throw std::runtime_error("Bad packet received from server");
+            }
+            if (files.getLength() == 0) {
+                incompletePull = true;
+                continue;
+            }
+
+            string newFilename = filenameIncrement(filename, filenames);
+            filenames.insert(newFilename);
+            string path = directory + newFilename;
+            string receivedChecksum;
+            TransferStats stats;
+            auto base = pullBases.find(filename);
+            if (!receiveFileChunks(*sockReader, path, receivedChecksum,
+                                   base == pullBases.end() ? nullptr : &base->second, &stats)) {
+                remove(path.c_str());
+                throw std::runtime_error("Server stopped sending " + path);
+            }
+            if (receivedChecksum != checksum) {
+                std::cerr << "Checksum mismatch, probable write or decode error" << endl;
+                remove(path.c_str());
+            } else {
+                wroteToClient.push_back(path + describeCompression(stats));
+            }
+        }
+    } catch (std::exception &e) {
+        shutdown(sock, SHUT_RDWR);
+        sender.join();
+        cout << (unsent.empty() ? string(e.what()) : "Unable to send " + unsent + " to server") << endl;
+        return;
+    }
+    sender.join();
+
+    cout << "Wrote to Server:" << endl;
+    for (const auto &filename : wroteToServer) {
+        cout << "\t+ " << filename << endl;
+    }
+    if (incompletePush) {
+        cout << "Incomplete Push. Consider trying again." << endl;
+    }
+    cout << "Wrote to Client:" << endl;
+    for (const auto &path : wroteToClient) {
+        cout << "\t+ " << path << endl;
+    }
+    if (incompletePull) {
+        cout << "Incomplete Pull. Consider trying again." << endl;
+    }
+}
+
 void handleSync(int sock) {
     cout << "Sync:" << endl;
     cout << "=====================" << endl;
 
-    auto answerJ = doList(sock);
-    if (!verifyJSONPacket(answerJ, "listResponse")) {
+    if (!listServerFiles(sock)) {
         cout << "Unable to verify listResponse from server!" << endl;
         return;
     }
 
-    auto diffStruct = doDiff(answerJ);
-    auto pullRequest = createPullRequestFromDiffJSON(diffStruct);
-    auto pushRequest = createPushRequestFromDiffJSON(diffStruct);  // creates a pushRequest w/o data
+    auto diffStruct = doDiff(serverListing.files);
+    double version = protocolVersion;
+    bool streaming = isStreamingVersion(version);
+    auto pullRequest = createPullRequestFromDiffJSON(diffStruct, version);
+    auto pushRequest = createPushRequestFromDiffJSON(diffStruct, version);  // no data when streaming
+    map<string, vector<Chunk>> pushBases;
+    map<string, DeltaBase> pullBases;
+    if (version >= DELTA_VERSION) {
+        pushBases = requestPushBases(sock, pushRequest, serverListing.files);
+        pullBases = addPullBases(pullRequest);
+    }
+    if (version >= PIPELINE_VERSION) {
+        syncPipelined(sock, pushRequest, pullRequest, pushBases, pullBases);
+        cout << "=====================" << endl << endl;
+        return;
+    }
 
-    sendToSocket(sock, pushRequest);
+    if (!sendToSocket(sock, pushRequest)) {
+        cout << "Unable to send push request to server" << endl;
+        return;
+    }
+    if (streaming) {
+        for (auto file : pushRequest["request"]) {
+            string path = directory + file["filename"].getString();
+            auto base = pushBases.find(file["filename"].getString());
+            bool sent = (base == pushBases.end()) ? sendFileChunks(sock, path, false)
+                                                  : sendFileDelta(sock, path, base->second, false);
+            if (!sent) {
+                cout << "Unable to send " << file["filename"].getString() << " to server" << endl;
+                return;
+            }
+        }
+    }
     json pushResponse = receiveResponse(sock);
     if(!verifyJSONPacket(pushResponse, "pushResponse")){
         cout << "Bad packet received from server" << endl;
@@ -368,7 +707,10 @@ void handleSync(int sock) {
         }
     }
 
-    sendToSocket(sock, pullRequest);
+    if (!sendToSocket(sock, pullRequest)) {
+        cout << "Unable to send pull request to server" << endl;
+        return;
+    }
     json pullResponse = receiveResponse(sock);
     if (!verifyJSONPacket(pullResponse, "pullResponse")) {
         cout << "Bad packet received from server" << endl;
@@ -376,6 +718,12 @@ void handleSync(int sock) {
     }
     if (!isResponseComplete(pullResponse, pullRequest)) {
         cout << "Incomplete Pull. Consider trying again." << endl;
+        if (streaming) {
+            // The server still sends the files it did find, so read past them
+            for (unsigned long i = 0; i < pullResponse["response"].getLength(); i++) {
+                discardFileChunks(*sockReader);
+            }
+        }
         return; // Return here, do not write bad data
     }
 
@@ -386,10 +734,23 @@ void handleSync(int sock) {
     }
     cout << "Wrote to Client:" << endl;
     for (auto fileDatum: pullResponse["response"]) {
-        string filename = directory + filenameIncrement(fileDatum["filename"].getString(), filenames);
-        writeBase64ToFile(filename, fileDatum["data"].getString());
-        MusicData d(filename);
-        if(d.getChecksum() != fileDatum["checksum"].getString()){
+        string newFilename = filenameIncrement(fileDatum["filename"].getString(), filenames);
+        filenames.insert(newFilename);
+        string filename = directory + newFilename;
+        string checksum;
+        if (streaming) {
+            auto base = pullBases.find(fileDatum["filename"].getString());
+            if (!receiveFileChunks(*sockReader, filename, checksum,
+                                   base == pullBases.end() ? nullptr : &base->second)) {
+                remove(filename.c_str());
+                cout << "Server stopped sending " << filename << endl;
+                return;
+            }
+        } else {
+            writeBase64ToFile(filename, fileDatum["data"].getString());
+            checksum = computeCRC(filename);
+        }
+        if(checksum != fileDatum["checksum"].getString()){
             std::cerr << "Checksum mismatch, probable write or decode error" << endl;
             // Delete the file
             remove(filename.c_str());
@@ -479,12 +840,15 @@ int main(int argc, char **argv) {
 
 
     sock = createTCPSocketAndConnect(serverHost, serverPort);
+    sockReader = new SocketReader(sock);
 
     struct sigaction sigIntHandler;
     sigIntHandler.sa_handler = interruptHandler;
     sigemptyset(&sigIntHandler.sa_mask);
     sigIntHandler.sa_flags = 0;
     sigaction(SIGINT, &sigIntHandler, nullptr);
+    // A server that goes away part way through a sync should fail that send, not kill the client
+    signal(SIGPIPE, SIG_IGN);
 
     userInteractionLoop(sock);
 
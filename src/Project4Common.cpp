@@ -1,5 +1,12 @@
 #include "Project4Common.h"
+#include "ThreadPool.h"
+#include <atomic>
 #include <cstdint>
+#include <limits>
+#include <unordered_map>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 using std::string;
 using std::vector;
@@ -59,6 +66,13 @@ MusicData::MusicData(const string &path) {
     this->checksum = makeChecksum();
 }
 
+// For when the checksum is already known, so the file doesn't need to be read
+MusicData::MusicData(const string &path, const string &checksum) {
+    this->path = path;
+    this->filename = ::getFilename(path);
+    this->checksum = checksum;
+}
+
 string MusicData::getFilename() {
     return this->filename;
 }
@@ -67,25 +81,31 @@ string MusicData::getChecksum() {
     return this->checksum;
 }
 
+string MusicData::getPath() {
+    return this->path;
+}
+
 json MusicData::getAsJSON(bool withData) {
     json fileJ = json();
 
-    fileJ["filename"] = this->filename;
+    fileJ["filename"] = JSON(this->filename, true);
     fileJ["checksum"] = JSON(this->checksum, true);
     if (withData) {
-        fileJ["data"] = b64Encode();
+        // The file is only read and encoded when the message is written out
+        string path = this->path;
+        fileJ["data"] = JSON(JSON::StringWriter([path](JSONSink &sink) {
+            writeFileAsBase64(path, sink);
+        }));
     }
 
     return fileJ;
 }
 
 string MusicData::b64Encode() {
-    ifstream input(this->path.c_str(), ios::binary);
-    // copies all data into buffer
-    vector<char> buffer((istreambuf_iterator<char>(input)),
-                        istreambuf_iterator<char>());
-    // Do base64 encoding and return as a string
-    return base64Encode(buffer);
+    string encoded;
+    JSONStringSink sink(encoded);
+    writeFileAsBase64(this->path, sink);
+    return encoded;
 }
 
 string MusicData::makeChecksum() {
@@ -117,6 +137,9 @@ vector<string> directoryFileListing(const string &path) {
     if ((dir = opendir(thisPath.c_str())) != nullptr) {
         while ((ent = readdir(dir)) != nullptr) {
             auto testFileDir = string(ent->d_name);
+            if (testFileDir.compare(0, INTERNAL_FILE_PREFIX.size(), INTERNAL_FILE_PREFIX) == 0) {
+                continue;
+            }
             if (!isDirectory(testFileDir)) {
                 listing.push_back(thisPath + testFileDir);
             }
@@ -130,12 +153,126 @@ vector<string> directoryFileListing(const string &path) {
     return listing;
 }
 
-vector<MusicData> list(const string &directory) {
+/*
+ * Call work(0) to work(count - 1) across a pool of threads shared by every caller, one per core counting the caller,
+ * which takes a share of the work too. Returns once every call has finished. The work must never wait on the pool.
+ */
+void runInParallel(size_t count, const std::function<void(size_t)> &work) {
+    static ThreadPool pool(ThreadPool::defaultSize() - 1);
+    std::atomic<size_t> next(0);
+    auto takeWork = [&next, count, &work] {
+        for (size_t i = next++; i < count; i = next++) {
+            work(i);
+        }
+    };
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t helpers = std::min(static_cast<size_t>(pool.size()), count > 0 ? count - 1 : 0);
+    size_t running = helpers;
+    for (size_t h = 0; h < helpers; h++) {
+        pool.submit([&] {
+            takeWork();
+            // Notified with the lock held, so the caller can't return and destroy these before this is done
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0) {
+                finished.notify_one();
+            }
+        });
+    }
+    takeWork();
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&running] { return running == 0; });
+}
+
+// Checksum the files at paths, taking each from index if it hasn't changed, and record the ones that had to be read
+static vector<MusicData> checksumFiles(ChecksumIndex &index, const vector<string> &paths) {
+    vector<string> checksums(paths.size());
+    vector<struct stat> stats(paths.size());
+    vector<bool> statted(paths.size());
+    vector<size_t> unknown;  // files whose checksums have to be computed
+    for (size_t i = 0; i < paths.size(); i++) {
+        statted[i] = stat(paths[i].c_str(), &stats[i]) == 0;
+        if (!statted[i] || !index.lookup(getFilename(paths[i]), stats[i], checksums[i])) {
+            unknown.push_back(i);
+        }
+    }
+
+    runInParallel(unknown.size(), [&paths, &checksums, &unknown](size_t u) {
+        checksums[unknown[u]] = computeCRC(paths[unknown[u]]);
+    });
+
     vector<MusicData> l;
-    for (auto d : directoryFileListing(directory)) {
-        l.push_back(MusicData(d));
+    l.reserve(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        l.push_back(MusicData(paths[i], checksums[i]));
+    }
+    for (size_t i : unknown) {
+        if (statted[i]) {
+            index.update(getFilename(paths[i]), stats[i], checksums[i]);
+        }
     }
+    return l;
+}
 
+/*
+ * Checksums come from the directory's ChecksumIndex when a file hasn't changed since it was last checksummed, so a
+ * listing normally only costs a stat() per file. Files that do need reading are checksummed on every core at once;
+ * the listing keeps the order of directoryFileListing() regardless.
+ */
+vector<MusicData> list(const string &directory) {
+    ChecksumIndex index(directory);
+    vector<string> paths = directoryFileListing(directory);
+    vector<MusicData> l = checksumFiles(index, paths);
+    set<string> filenames;
+    for (const auto &path : paths) {
+        filenames.insert(getFilename(path));
+    }
+    index.retainOnly(filenames);
+    index.save();
+
+    return l;
+}
+
+/*
+ * Look up one file as a listing would show it, without listing the directory: a stat(), and the checksum from the
+ * ChecksumIndex unless the file has changed since. Returns false if there's no such file.
+ */
+bool findFile(const string &directory, const string &filename, string &checksum) {
+    string path = directory + (directory.back() == '/' ? "" : "/") + filename;
+    struct stat statStruct;
+    if (!isListedFilename(filename) || stat(path.c_str(), &statStruct) != 0 || !S_ISREG(statStruct.st_mode)) {
+        return false;
+    }
+    ChecksumIndex index(directory);
+    if (!index.lookup(filename, statStruct, checksum)) {
+        checksum = computeCRC(path);
+        index.update(filename, statStruct, checksum);
+        index.save();
+    }
+    return true;
+}
+
+/*
+ * One page of a listing: the first count files, in order of name, whose names sort after the given one. Only the
+ * files on the page are stat()ed and checksummed, so walking a directory a page at a time costs little more than
+ * listing it once.
+ */
+vector<MusicData> list(const string &directory, const string &after, size_t count) {
+    vector<string> paths;
+    for (auto &path : directoryFileListing(directory)) {
+        if (getFilename(path) > after) {
+            paths.push_back(std::move(path));
+        }
+    }
+    // Every path starts with the directory, so they sort by filename
+    size_t pageLength = std::min(count, paths.size());
+    std::partial_sort(paths.begin(), paths.begin() + pageLength, paths.end());
+    paths.resize(pageLength);
+
+    ChecksumIndex index(directory);
+    vector<MusicData> l = checksumFiles(index, paths);
+    index.save();
     return l;
 }
 
@@ -157,60 +294,929 @@ in_addr_t hostOrIPToInet(const string &host) {
     return inet_addr(inet_ntoa(*addr_list[0]));
 }
 
+const size_t SOCKET_READ_SIZE = 64 * 1024;
+
+SocketReader::SocketReader(int sock)
+        : sock(sock), buffer(SOCKET_READ_SIZE), readPos(0), writePos(0), searchPos(0), drainWriter(nullptr) {}
+
+// Keep sending whatever is queued on writer whenever this has to wait for the socket
+void SocketReader::drainWhileWaiting(SocketWriter *writer) {
+    this->drainWriter = writer;
+}
+
+/*
+ * Wait until there is something to receive. Responses queued on the drain writer keep going out meanwhile, so a
+ * request that arrives in pieces, like a pushed file, doesn't stop earlier responses from being sent.
+ */
+bool SocketReader::waitForData() {
+    while (this->drainWriter != nullptr && this->drainWriter->pending() > 0) {
+        SocketWriter::FlushStatus status = this->drainWriter->flush();
+        if (status == SocketWriter::Failed) {
+            return false;
+        }
+        if (status == SocketWriter::Flushed) {
+            break;
+        }
+        struct pollfd pfd;
+        pfd.fd = this->sock;
+        pfd.events = POLLIN | POLLOUT;
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return false;
+        }
+        // Readable, or an error that recv() will report
+        if (pfd.revents & ~POLLOUT) {
+            return true;
+        }
+    }
+    return waitForSocket(this->sock, POLLIN);
+}
+
 /*
- * Keep trying to receive until a specific byte is read from the server
- * 
+ * Make room for at least SOCKET_READ_SIZE more bytes, compacting or growing the buffer if needed, and make a single
+ * recv() call into it. Returns whatever recv() returned.
  */
-string receiveUntilByteEquals(int sock, char eq) {
-    char dataBuffer;
-    ssize_t bytesRead = 0;
-    string fullMessage;
+ssize_t SocketReader::receiveIntoBuffer() {
+    if (this->readPos > 0) {
+        // Move leftover bytes to the front so the free space is contiguous
+        memmove(this->buffer.data(), this->buffer.data() + this->readPos, this->writePos - this->readPos);
+        this->writePos -= this->readPos;
+        this->searchPos -= this->readPos;
+        this->readPos = 0;
+    }
+    if (this->buffer.size() - this->writePos < SOCKET_READ_SIZE) {
+        this->buffer.resize(this->buffer.size() * 2);
+    }
+
+    ssize_t bytesRead = recv(this->sock, this->buffer.data() + this->writePos, this->buffer.size() - this->writePos, 0);
+    if (bytesRead > 0) {
+        this->writePos += bytesRead;
+    }
+    return bytesRead;
+}
 
+/*
+ * Block until at least one more byte has been received, even if the socket is non-blocking. Returns false if the
+ * socket was closed or errored.
+ */
+bool SocketReader::fillBuffer() {
     while (true) {
-        // Receive data
-        bytesRead = recv(sock, &dataBuffer, sizeof(dataBuffer), 0);
+        ssize_t bytesRead = this->receiveIntoBuffer();
 
+        if (bytesRead > 0) {
+            return true;
+        }
         // Make sure read was successful
         if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && this->waitForData()) {
+                continue;
+            }
             perror("Error receiving data");
-            return fullMessage;
+            return false;
         }
             // Make sure the socket wasn't closed
-        else if (bytesRead == 0) {
+        else {
             perror("Unexpected end of transmission from server");
+            return false;
+        }
+    }
+}
+
+/*
+ * Keep trying to receive until a specific byte is read from the socket. Anything received after that byte stays
+ * buffered for the next call.
+ */
+string SocketReader::receiveUntilByteEquals(char eq) {
+    while (!this->hasBufferedMessage(eq)) {
+        if (!this->fillBuffer()) {
+            string fullMessage(this->buffer.data() + this->readPos, this->writePos - this->readPos);
+            this->readPos = this->writePos = this->searchPos = 0;
             return fullMessage;
         }
+    }
+
+    // hasBufferedMessage() left searchPos on the delimiter
+    string fullMessage(this->buffer.data() + this->readPos, this->searchPos - this->readPos);
+    this->readPos = this->searchPos = this->searchPos + 1;
+    return fullMessage;
+}
+
+/*
+ * For non-blocking sockets: receive whatever has arrived, without waiting, until a complete message is buffered.
+ * Stops as soon as there is one, so that anything sent after it stays in the socket for whoever handles the message.
+ */
+SocketReader::ReceiveStatus SocketReader::receiveAvailable(char eq) {
+    while (!this->hasBufferedMessage(eq)) {
+        ssize_t bytesRead = this->receiveIntoBuffer();
+        if (bytesRead == 0) {
+            return Closed;
+        }
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? WouldBlock : Closed;
+        }
+    }
+    return MessageReady;
+}
+
+/*
+ * Fill dest with exactly length bytes, using up whatever is already buffered first and then reading the rest
+ * straight from the socket. Returns false if the socket closed before that many bytes arrived.
+ */
+bool SocketReader::receiveExactly(char *dest, size_t length) {
+    size_t buffered = std::min(length, this->writePos - this->readPos);
+    memcpy(dest, this->buffer.data() + this->readPos, buffered);
+    this->readPos += buffered;
+    this->searchPos = std::max(this->searchPos, this->readPos);
+
+    size_t received = buffered;
+    while (received < length) {
+        ssize_t bytesRead = recv(this->sock, dest + received, length - received, 0);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && this->waitForData()) {
+                continue;
+            }
+            perror("Error receiving data");
+            return false;
+        } else if (bytesRead == 0) {
+            perror("Unexpected end of transmission from server");
+            return false;
+        }
+        received += bytesRead;
+    }
+    return true;
+}
+
+/*
+ * Only bytes that haven't been searched before are searched, so waiting on a large message stays linear. Frames
+ * aren't searched at all; they're complete once as many bytes as their header says have arrived.
+ */
+bool SocketReader::hasBufferedMessage(char eq) {
+    size_t available = this->writePos - this->readPos;
+    if (available > 0 && static_cast<unsigned char>(this->buffer[this->readPos]) == FRAME_MARKER) {
+        FrameHeader header;
+        return available >= FRAME_HEADER_LENGTH
+               && decodeFrameHeader(this->buffer.data() + this->readPos, header)
+               && available - FRAME_HEADER_LENGTH >= header.length;
+    }
+
+    auto found = static_cast<const char *>(memchr(this->buffer.data() + this->searchPos, eq,
+                                                  this->writePos - this->searchPos));
+    if (found == nullptr) {
+        this->searchPos = this->writePos;
+        return false;
+    }
+    this->searchPos = found - this->buffer.data();
+    return true;
+}
+
+// Wait for the next message to start arriving, and say whether it's framed
+bool SocketReader::nextIsFrame() {
+    if (this->readPos == this->writePos && !this->fillBuffer()) {
+        return false;
+    }
+    return static_cast<unsigned char>(this->buffer[this->readPos]) == FRAME_MARKER;
+}
+
+/*
+ * Receive a frame. The header says how big the body is, so it's allocated once and whatever isn't buffered yet is
+ * read straight into it. Returns false if the socket closed first.
+ */
+bool SocketReader::receiveFrame(FrameHeader &header, string &body) {
+    char headerBytes[FRAME_HEADER_LENGTH];
+    if (!this->receiveExactly(headerBytes, FRAME_HEADER_LENGTH) || !decodeFrameHeader(headerBytes, header)) {
+        return false;
+    }
+    body.resize(header.length);
+    return this->receiveExactly(&body[0], header.length);
+}
 
-        // Check if we received the end of transmission byte we were expecting
-        if (dataBuffer == eq) {
+// Wait until the socket is ready for events (POLLIN and/or POLLOUT). Returns false on error.
+bool waitForSocket(int sock, short events) {
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = events;
+    while (true) {
+        int ready = poll(&pfd, 1, -1);
+        if (ready > 0) {
+            return true;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+bool setNonBlocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+SocketWriter::SocketWriter(int sock) : sock(sock), pendingBytes(0), bufferedBytes(0) {}
+
+SocketWriter::~SocketWriter() {
+    for (auto &piece : this->pieces) {
+        if (piece.fd >= 0) {
+            close(piece.fd);
+        }
+    }
+}
+
+void SocketWriter::queue(string data) {
+    if (data.empty()) {
+        return;
+    }
+    size_t length = data.size();
+    this->pendingBytes += length;
+    this->pieces.push_back(Piece{std::move(data), -1, 0, length, string(), false});
+    this->bufferedBytes += this->pieces.back().memoryUsed();
+}
+
+// Queue a message and its delimiter as separate pieces, so the payload never needs to be copied to append it
+void SocketWriter::queueMessage(string payload) {
+    this->queue(std::move(payload));
+    this->queue(string(1, '\n'));
+}
+
+// Queue length bytes of a file starting at offset. The writer closes fd once they've been sent.
+void SocketWriter::queueFile(int fd, off_t offset, size_t length) {
+    if (length == 0) {
+        close(fd);
+        return;
+    }
+    this->pendingBytes += length;
+    this->pieces.push_back(Piece{string(), fd, offset, length, string(), false});
+    this->bufferedBytes += this->pieces.back().memoryUsed();
+}
+
+/*
+ * Queue length bytes of the file at path starting at offset. The file isn't opened until its turn comes, so any
+ * number of files can be queued without running out of descriptors.
+ */
+void SocketWriter::queueFilePath(string path, off_t offset, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    this->pendingBytes += length;
+    this->pieces.push_back(Piece{string(), -1, offset, length, std::move(path), false});
+    this->bufferedBytes += this->pieces.back().memoryUsed();
+}
+
+/*
+ * Queue length bytes of the file at path starting at offset, to be sent as data frames whose blocks are compressed
+ * if that makes them smaller. Each block is only read and compressed once the socket is ready for it, so a large file
+ * never sits in memory. Until then the range counts as pending at its uncompressed length.
+ */
+void SocketWriter::queueCompressedFile(string path, off_t offset, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    this->pendingBytes += length;
+    this->pieces.push_back(Piece{string(), -1, offset, length, std::move(path), true});
+    this->bufferedBytes += this->pieces.back().memoryUsed();
+}
+
+ssize_t SocketWriter::sendFilePiece(const Piece &piece) {
+#ifdef __linux__
+    off_t offset = piece.offset;
+    // sendfile() won't move more than about 2 GiB in one call
+    return sendfile(this->sock, piece.fd, &offset, std::min(piece.length, static_cast<size_t>(0x7ffff000)));
+#else
+    char buffer[FILE_CHUNK_SIZE];
+    ssize_t bytesRead = pread(piece.fd, buffer, std::min(piece.length, FILE_CHUNK_SIZE), piece.offset);
+    if (bytesRead <= 0) {
+        return bytesRead;
+    }
+    return send(this->sock, buffer, static_cast<size_t>(bytesRead), 0);
+#endif
+}
+
+static void appendFrameWord(string &out, uint32_t word);
+
+static void appendBlockFrame(string &out, const char *data, size_t length);
+
+/*
+ * Replace the first block of the compressed file range at the front of the queue with its frame, ready to send.
+ * Returns false if the file can't be read.
+ */
+bool SocketWriter::compressNextBlock() {
+    Piece &front = this->pieces.front();
+    if (front.fd < 0) {
+        front.fd = open(front.path.c_str(), O_RDONLY);
+        if (front.fd < 0) {
+            perror(("Could not open " + front.path).c_str());
+            return false;
+        }
+    }
+    size_t blockLength = std::min(front.length, FILE_CHUNK_SIZE);
+    vector<char> block(blockLength);
+    size_t blockRead = 0;
+    while (blockRead < blockLength) {
+        ssize_t bytesRead = pread(front.fd, block.data() + blockRead, blockLength - blockRead,
+                                  front.offset + static_cast<off_t>(blockRead));
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            std::cerr << "File was truncated while it was being sent" << std::endl;
+            return false;
+        }
+        blockRead += bytesRead;
+    }
+
+    string frame;
+    appendBlockFrame(frame, block.data(), blockLength);
+    front.offset += blockLength;
+    front.length -= blockLength;
+    this->pendingBytes -= blockLength;
+    if (front.length == 0) {
+        close(front.fd);
+        this->bufferedBytes -= front.memoryUsed();
+        this->pieces.pop_front();
+    }
+    size_t frameLength = frame.size();
+    this->pendingBytes += frameLength;
+    this->pieces.push_front(Piece{std::move(frame), -1, 0, frameLength, string(), false});
+    this->bufferedBytes += this->pieces.front().memoryUsed();
+    return true;
+}
+
+// Drop every piece that went out completely, and remember how far into the next one we got
+void SocketWriter::consume(size_t bytesSent) {
+    this->pendingBytes -= bytesSent;
+    while (bytesSent > 0) {
+        Piece &front = this->pieces.front();
+        if (bytesSent < front.length) {
+            front.offset += bytesSent;
+            front.length -= bytesSent;
+            return;
+        }
+        bytesSent -= front.length;
+        if (front.fd >= 0) {
+            close(front.fd);
+        }
+        this->bufferedBytes -= front.memoryUsed();
+        this->pieces.pop_front();
+    }
+}
+
+/*
+ * Write as much of the queue as the socket will take right now. On a blocking socket that's all of it; on a
+ * non-blocking one this returns WouldBlock once the socket buffer is full.
+ */
+SocketWriter::FlushStatus SocketWriter::flush() {
+    const size_t maxPieces = 64;
+    struct iovec iov[maxPieces];
+
+    while (!this->pieces.empty()) {
+        ssize_t bytesSent;
+        Piece &front = this->pieces.front();
+        if (front.compress) {
+            if (!this->compressNextBlock()) {
+                return Failed;
+            }
+            continue;
+        }
+        if (front.isFile()) {
+            if (front.fd < 0) {
+                front.fd = open(front.path.c_str(), O_RDONLY);
+                if (front.fd < 0) {
+                    perror(("Could not open " + front.path).c_str());
+                    return Failed;
+                }
+            }
+            bytesSent = this->sendFilePiece(front);
+            if (bytesSent == 0) {
+                // The length of this file was already promised to the other side, so there's no way to recover
+                std::cerr << "File was truncated while it was being sent" << std::endl;
+                return Failed;
+            }
+        } else {
+            // Gather every in-memory piece up to the next file piece
+            size_t count = 0;
+            for (auto it = this->pieces.begin(); it != this->pieces.end() && !it->isFile() && count < maxPieces;
+                 ++it, ++count) {
+                iov[count].iov_base = const_cast<char *>(it->data.data()) + it->offset;
+                iov[count].iov_len = it->length;
+            }
+            bytesSent = writev(this->sock, iov, static_cast<int>(count));
+        }
+
+        if (bytesSent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return WouldBlock;
+            }
+            perror("Could not send");
+            return Failed;
+        }
+        this->consume(static_cast<size_t>(bytesSent));
+    }
+    return Flushed;
+}
+
+// Send until no more than limit bytes are left queued, waiting for the socket if needed. Returns false on error.
+bool SocketWriter::flushBelow(size_t limit) {
+    while (this->pendingBytes > limit) {
+        FlushStatus status = this->flush();
+        if (status == Failed || (status == WouldBlock && !waitForSocket(this->sock, POLLOUT))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t SocketWriter::pending() const {
+    return this->pendingBytes;
+}
+
+// How much memory the queue is holding. Queued file ranges only cost their bookkeeping.
+size_t SocketWriter::buffered() const {
+    return this->bufferedBytes;
+}
+
+SocketWriterSink::SocketWriterSink(SocketWriter &writer, size_t flushAbove)
+        : writer(writer), flushAbove(flushAbove), failed(false) {}
+
+void SocketWriterSink::write(const char *data, size_t length) {
+    if (this->buffer.size() + length > FILE_CHUNK_SIZE) {
+        this->queueBuffer();
+    }
+    // Large pieces, like file data, are queued as they are rather than copied into the buffer
+    if (length >= FILE_CHUNK_SIZE) {
+        this->writer.queue(string(data, length));
+    } else {
+        this->buffer.append(data, length);
+        return;
+    }
+    if (!this->failed && this->writer.pending() > this->flushAbove) {
+        this->failed = !this->writer.flushBelow(this->flushAbove);
+    }
+}
+
+void SocketWriterSink::queueBuffer() {
+    this->writer.queue(std::move(this->buffer));
+    this->buffer = string();
+    this->buffer.reserve(FILE_CHUNK_SIZE);
+}
+
+// Queue whatever is still buffered. Returns false if sending failed along the way.
+bool SocketWriterSink::finish() {
+    this->queueBuffer();
+    return !this->failed;
+}
+
+// Messages are sent in the binary encoding when they're for version 3 or later
+static bool isBinaryMessage(const json &data) {
+    return data.hasKey("version") && data["version"].getNumber() >= BINARY_VERSION;
+}
+
+/*
+ * Queue a message and send as much of it as the socket takes right now, without waiting. Whatever is left is sent
+ * later by whoever flushes the writer next.
+ */
+bool sendToSocket(SocketWriter &writer, const json &data) {
+    if (isBinaryMessage(data)) {
+        writer.queue(encodeBinaryMessage(data));
+        return writer.flush() != SocketWriter::Failed;
+    }
+    SocketWriterSink sink(writer, std::numeric_limits<size_t>::max());
+    data.write(sink);
+    sink.write('\n');
+    return sink.finish() && writer.flush() != SocketWriter::Failed;
+}
+
+bool sendToSocket(int socket, string data) {
+    SocketWriter writer(socket);
+    writer.queueMessage(std::move(data));
+    return writer.flushBelow(0);
+}
+
+// Send a message, writing it out as it's serialized so that large messages are never held in memory all at once
+bool sendToSocket(int socket, const json &data) {
+    SocketWriter writer(socket);
+    if (isBinaryMessage(data)) {
+        writer.queue(encodeBinaryMessage(data));
+        return writer.flushBelow(0);
+    }
+    SocketWriterSink sink(writer, 4 * FILE_CHUNK_SIZE);
+    data.write(sink);
+    sink.write('\n');
+    return sink.finish() && writer.flushBelow(0);
+}
+
+// Receive the next message, in whichever encoding the other side sent it. Throws if it isn't a valid message.
+json receiveMessage(SocketReader &reader) {
+    if (reader.nextIsFrame()) {
+        FrameHeader header;
+        string body;
+        if (!reader.receiveFrame(header, body)) {
+            throw std::runtime_error("Connection closed part way through a message");
+        }
+        return decodeBinaryMessage(header, body.data());
+    }
+    return json::view(reader.receiveUntilByteEquals('\n'), std::make_shared<JSONArena>());
+}
+
+static void appendFrameWord(string &out, uint32_t word) {
+    uint32_t networkWord = htonl(word);
+    out.append(reinterpret_cast<const char *>(&networkWord), sizeof(networkWord));
+}
+
+// Append a block of a file as a compressed frame, or as an ordinary data frame if compressing it doesn't help
+static void appendBlockFrame(string &out, const char *data, size_t length) {
+    size_t start = out.size();
+    appendFrameWord(out, COMPRESSED_FRAME);
+    out.append(2 * sizeof(uint32_t), '\0');  // filled in once the compressed length is known
+    size_t headerEnd = out.size();
+    compressBlock(data, length, out);
+    size_t compressedLength = out.size() - headerEnd;
+    if (compressedLength + 2 * sizeof(uint32_t) >= length) {
+        out.resize(start);
+        appendFrameWord(out, static_cast<uint32_t>(length));
+        out.append(data, length);
+        return;
+    }
+    string lengths;
+    appendFrameWord(lengths, static_cast<uint32_t>(compressedLength));
+    appendFrameWord(lengths, static_cast<uint32_t>(length));
+    out.replace(start + sizeof(uint32_t), lengths.size(), lengths);
+}
+
+/*
+ * Queue length bytes of the file at path from offset as data frames, compressing them as they go out if compress is
+ * set. Ranges are queued by path, so a client with many pulls in flight doesn't hold a descriptor open for each one.
+ */
+static void queueFileFrames(SocketWriter &writer, const string &path, off_t offset, size_t length, bool compress) {
+    if (compress) {
+        writer.queueCompressedFile(path, offset, length);
+        return;
+    }
+    const size_t maxFrameLength = COPY_FRAME_FLAG - 1;
+    while (length > 0) {
+        size_t frameLength = std::min(length, maxFrameLength);
+        string header;
+        appendFrameWord(header, static_cast<uint32_t>(frameLength));
+        writer.queue(std::move(header));
+        writer.queueFilePath(path, offset, frameLength);
+        offset += frameLength;
+        length -= frameLength;
+    }
+}
+
+/*
+ * Stream a file as chunk frames: each frame is a 4 byte big-endian length followed by that many bytes of the file.
+ * A frame of length 0 marks the end of the file. The file itself is only queued, not read; it's sent with sendfile()
+ * as the socket accepts it, in frames as large as the length field allows without setting COPY_FRAME_FLAG. If
+ * compress is set and the file looks like it will compress, it's sent in compressed frames of FILE_CHUNK_SIZE instead.
+ */
+bool sendFileChunks(SocketWriter &writer, const string &path, bool compress) {
+    struct stat fileStat;
+    if (stat(path.c_str(), &fileStat) != 0) {
+        perror(("Could not stat " + path).c_str());
+        return false;
+    }
+
+    compress = compress && isWorthCompressing(getFilename(path), path);
+    queueFileFrames(writer, path, 0, static_cast<size_t>(fileStat.st_size), compress);
+    writer.queue(string(sizeof(uint32_t), '\0'));
+    return writer.flush() != SocketWriter::Failed;
+}
+
+bool sendFileChunks(int socket, const string &path, bool compress) {
+    SocketWriter writer(socket);
+    return sendFileChunks(writer, path, compress) && writer.flushBelow(0);
+}
+
+// Finds which chunk of a delta's base, if any, is the same as a given chunk
+class BaseIndex {
+public:
+    explicit BaseIndex(const vector<Chunk> &baseChunks) : baseChunks(baseChunks) {
+        // The highest index would be read as COMPRESSED_FRAME
+        for (uint32_t i = 0; i < baseChunks.size() && i < COPY_FRAME_FLAG - 1; i++) {
+            this->indexes.emplace(baseChunks[i].hash, i);
+        }
+    }
+
+    bool find(const Chunk &chunk, uint32_t &index) const {
+        auto found = this->indexes.find(chunk.hash);
+        if (found == this->indexes.end() || this->baseChunks[found->second].length != chunk.length) {
+            return false;
+        }
+        index = found->second;
+        return true;
+    }
+
+private:
+    const vector<Chunk> &baseChunks;
+    std::unordered_map<uint64_t, uint32_t> indexes;
+};
+
+/*
+ * Send a file as a delta against a file the receiver has, given the chunks that one splits into. The file is chunked
+ * the same way, and every chunk the receiver already has is sent as a copy frame naming it; runs of the rest are sent
+ * as ordinary data frames straight from the file, so a receiver that reads it with receiveFileChunks() gets the same
+ * file that sendFileChunks() would have sent.
+ */
+bool sendFileDelta(SocketWriter &writer, const string &path, const vector<Chunk> &baseChunks, bool compress) {
+    vector<Chunk> chunks;
+    if (!chunkFile(path, chunks)) {
+        perror(("Could not open " + path).c_str());
+        return false;
+    }
+    compress = compress && isWorthCompressing(getFilename(path), path);
+
+    BaseIndex baseIndex(baseChunks);
+
+    // Copy frames are gathered up and queued together, in front of the next run of data
+    string copyFrames;
+    off_t offset = 0;
+    off_t runStart = 0;
+    for (const auto &chunk : chunks) {
+        uint32_t index;
+        if (baseIndex.find(chunk, index)) {
+            if (offset > runStart) {
+                writer.queue(std::move(copyFrames));
+                copyFrames.clear();
+                queueFileFrames(writer, path, runStart, static_cast<size_t>(offset - runStart), compress);
+            }
+            appendFrameWord(copyFrames, COPY_FRAME_FLAG | index);
+            runStart = offset + chunk.length;
+        }
+        offset += chunk.length;
+    }
+    writer.queue(std::move(copyFrames));
+    if (offset > runStart) {
+        queueFileFrames(writer, path, runStart, static_cast<size_t>(offset - runStart), compress);
+    }
+
+    writer.queue(string(sizeof(uint32_t), '\0'));
+    return writer.flush() != SocketWriter::Failed;
+}
+
+/*
+ * Send a file that's kept as one file per chunk, the way sendFileDelta() would send it. Every chunk that isn't in
+ * baseChunks goes in a data frame of its own, straight from its file, or compressed from it if compress is set.
+ */
+bool sendChunkedFile(SocketWriter &writer, const vector<Chunk> &chunks, const vector<string> &chunkPaths,
+                     const vector<Chunk> &baseChunks, bool compress) {
+    BaseIndex baseIndex(baseChunks);
+    string frames;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        uint32_t index;
+        if (baseIndex.find(chunks[i], index)) {
+            appendFrameWord(frames, COPY_FRAME_FLAG | index);
+            continue;
+        }
+        writer.queue(std::move(frames));
+        frames.clear();
+        queueFileFrames(writer, chunkPaths[i], 0, chunks[i].length, compress);
+    }
+    appendFrameWord(frames, 0);
+    writer.queue(std::move(frames));
+    return writer.flush() != SocketWriter::Failed;
+}
+
+bool sendFileDelta(int socket, const string &path, const vector<Chunk> &baseChunks, bool compress) {
+    SocketWriter writer(socket);
+    return sendFileDelta(writer, path, baseChunks, compress) && writer.flushBelow(0);
+}
+
+bool receiveFileChunks(SocketReader &reader, const string &path, string &checksum) {
+    return receiveFileChunks(reader, path, checksum, nullptr);
+}
+
+// Writes received data to a file, or nowhere if it has no path
+class PathSink : public FileSink {
+public:
+    explicit PathSink(const string &path) {
+        if (!path.empty()) {
+            this->fileWriter.open(path, std::ios::binary | std::ios::trunc);
+        }
+    }
+
+    bool write(const char *data, size_t length) override {
+        if (this->fileWriter.is_open()) {
+            this->fileWriter.write(data, length);
+        }
+        return true;
+    }
+
+    bool finish() override {
+        if (this->fileWriter.is_open()) {
+            this->fileWriter.close();
+            return !this->fileWriter.fail();
+        }
+        return true;
+    }
+
+private:
+    std::ofstream fileWriter;
+};
+
+bool receiveFileChunks(SocketReader &reader, const string &path, string &checksum, const DeltaBase *base) {
+    return receiveFileChunks(reader, path, checksum, base, nullptr);
+}
+
+bool receiveFileChunks(SocketReader &reader, const string &path, string &checksum, const DeltaBase *base,
+                       TransferStats *stats) {
+    PathSink sink(path);
+    return receiveFileChunks(reader, sink, checksum, base, stats);
+}
+
+// Read chunk index of base into dest. Returns false if base doesn't have it.
+static bool readBaseChunk(const DeltaBase &base, const vector<off_t> &offsets, std::ifstream &baseReader,
+                          uint32_t index, char *dest) {
+    if (index >= base.chunks.size()) {
+        return false;
+    }
+    size_t length = base.chunks[index].length;
+    if (!base.chunkPaths.empty()) {
+        std::ifstream chunkReader(base.chunkPaths[index], std::ios::binary);
+        return static_cast<bool>(chunkReader.read(dest, length));
+    }
+    baseReader.clear();
+    baseReader.seekg(offsets[index]);
+    return static_cast<bool>(baseReader.read(dest, length));
+}
+
+/*
+ * Receive chunk frames sent by sendFileChunks() or sendFileDelta() and write them to sink. Frames may be of any size;
+ * they are read in FILE_CHUNK_SIZE pieces so memory use doesn't depend on the sender. Copy frames are filled in from
+ * base, and compressed frames decompressed. The checksum of the received data is computed along the way, so the file
+ * doesn't need to be read back to verify it. If a copy frame can't be filled in, or a compressed one is corrupt, the
+ * rest of the file is still read but the checksum is left empty, so it won't match the one the file was sent with.
+ * If stats is given, it's filled in with how much data came in data frames and how much space those took.
+ */
+bool receiveFileChunks(SocketReader &reader, FileSink &sink, string &checksum, const DeltaBase *base) {
+    return receiveFileChunks(reader, sink, checksum, base, nullptr);
+}
+
+bool receiveFileChunks(SocketReader &reader, FileSink &sink, string &checksum, const DeltaBase *base,
+                       TransferStats *stats) {
+    CRC32State crc;
+    vector<char> chunk(std::max(FILE_CHUNK_SIZE, MAX_CHUNK_SIZE));
+    vector<char> compressed;
+    TransferStats transfer{0, 0, false};
+
+    std::ifstream baseReader;
+    vector<off_t> baseOffsets;
+    if (base != nullptr) {
+        if (base->chunkPaths.empty()) {
+            baseReader.open(base->path, std::ios::binary);
+        }
+        off_t offset = 0;
+        for (const auto &baseChunk : base->chunks) {
+            baseOffsets.push_back(offset);
+            offset += baseChunk.length;
+        }
+    }
+    bool missingBase = false;
+    bool corrupt = false;
+    bool written = true;
+
+    while (true) {
+        uint32_t networkLength;
+        if (!reader.receiveExactly(reinterpret_cast<char *>(&networkLength), sizeof(networkLength))) {
+            sink.finish();
+            return false;
+        }
+        uint32_t length = ntohl(networkLength);
+        if (length == 0) {
             break;
         }
 
-        // Append to our message buffer
-        fullMessage += dataBuffer;
+        if (length == COMPRESSED_FRAME) {
+            uint32_t lengths[2];
+            if (!reader.receiveExactly(reinterpret_cast<char *>(lengths), sizeof(lengths))) {
+                sink.finish();
+                return false;
+            }
+            size_t compressedLength = ntohl(lengths[0]);
+            size_t blockLength = ntohl(lengths[1]);
+            // No sender makes blocks any bigger, so these can only be garbage, and there's no telling where it ends
+            if (blockLength > FILE_CHUNK_SIZE || compressedLength > compressBound(FILE_CHUNK_SIZE)) {
+                sink.finish();
+                return false;
+            }
+            compressed.resize(compressedLength);
+            if (!reader.receiveExactly(compressed.data(), compressedLength)) {
+                sink.finish();
+                return false;
+            }
+            transfer.fileBytes += blockLength;
+            transfer.wireBytes += sizeof(uint32_t) + sizeof(lengths) + compressedLength;
+            transfer.compressed = true;
+            if (!decompressBlock(compressed.data(), compressedLength, chunk.data(), blockLength)) {
+                corrupt = true;
+                continue;
+            }
+            written = sink.write(chunk.data(), blockLength) && written;
+            crc.update(chunk.data(), blockLength);
+            continue;
+        }
+
+        if (length & COPY_FRAME_FLAG) {
+            uint32_t index = length & ~COPY_FRAME_FLAG;
+            if (base == nullptr || !readBaseChunk(*base, baseOffsets, baseReader, index, chunk.data())) {
+                missingBase = true;
+                continue;
+            }
+            size_t chunkLength = base->chunks[index].length;
+            written = sink.write(chunk.data(), chunkLength) && written;
+            crc.update(chunk.data(), chunkLength);
+            continue;
+        }
+
+        transfer.fileBytes += length;
+        transfer.wireBytes += sizeof(networkLength) + length;
+        while (length > 0) {
+            size_t piece = std::min(static_cast<size_t>(length), FILE_CHUNK_SIZE);
+            if (!reader.receiveExactly(chunk.data(), piece)) {
+                sink.finish();
+                return false;
+            }
+            written = sink.write(chunk.data(), piece) && written;
+            crc.update(chunk.data(), piece);
+            length -= piece;
+        }
     }
 
-    return fullMessage;
+    if (stats != nullptr) {
+        *stats = transfer;
+    }
+    checksum = (missingBase || corrupt) ? string() : crc.toString();
+    return sink.finish() && written;
 }
 
-void sendToSocket(int socket, const string &data) {
-    string myData = data + '\n';
+bool discardFileChunks(SocketReader &reader) {
+    string checksum;
+    return receiveFileChunks(reader, "", checksum);
+}
 
-    if (send(socket, myData.c_str(), myData.size(), 0) < 0) {
-        perror("Could not send");
-        exit(1);
+// Say how much of its size a received file took to send, if it came compressed, for showing after its name
+string describeCompression(const TransferStats &stats) {
+    if (!stats.compressed || stats.fileBytes == 0) {
+        return string();
     }
+    return " (compressed to " + std::to_string(stats.wireBytes * 100 / stats.fileBytes) + "%)";
+}
+
+bool isSupportedVersion(double version) {
+    return version == VERSION || version == STREAMING_VERSION || version == BINARY_VERSION ||
+           version == DELTA_VERSION || version == PIPELINE_VERSION || version == COMPRESSION_VERSION ||
+           version == PAGED_LIST_VERSION || version == LIST_SINCE_VERSION;
 }
 
-void sendToSocket(int socket, const json &data) {
-    sendToSocket(socket, data.stringify());
+// Every version from 2 on streams file bodies after the message
+bool isStreamingVersion(double version) {
+    return version >= STREAMING_VERSION;
+}
+
+// Pick the highest version that both we and the server that sent this listResponse understand
+double negotiateVersion(const json &listResponse) {
+    double maxVersion = VERSION;
+    if (listResponse.hasKey("maxVersion") && listResponse["maxVersion"].isNumber()) {
+        maxVersion = listResponse["maxVersion"].getNumber();
+    }
+    if (maxVersion >= LIST_SINCE_VERSION) {
+        return LIST_SINCE_VERSION;
+    }
+    if (maxVersion >= PAGED_LIST_VERSION) {
+        return PAGED_LIST_VERSION;
+    }
+    if (maxVersion >= COMPRESSION_VERSION) {
+        return COMPRESSION_VERSION;
+    }
+    if (maxVersion >= PIPELINE_VERSION) {
+        return PIPELINE_VERSION;
+    }
+    if (maxVersion >= DELTA_VERSION) {
+        return DELTA_VERSION;
+    }
+    if (maxVersion >= BINARY_VERSION) {
+        return BINARY_VERSION;
+    }
+    if (maxVersion >= STREAMING_VERSION) {
+        return STREAMING_VERSION;
+    }
+    return VERSION;
 }
 
 bool verifyJSONPacket(const json &data) {
     bool verified = true;
 
     verified = verified && data.isObject() && data.hasKey("version")
-               && data.hasKey("type") && data["version"].getNumber() == VERSION
+               && data.hasKey("type") && isSupportedVersion(data["version"].getNumber())
                && data["type"].isString();
 
     if (!verified) {
@@ -220,11 +1226,21 @@ bool verifyJSONPacket(const json &data) {
     std::string type = data["type"].getString();
 
     if (type == "listRequest") {
-        return verified;
+        return verified && (!data.hasKey("limit") || data["limit"].isNumber())
+               && (!data.hasKey("after") || data["after"].isString());
     }
     if (type == "listResponse") {
         return verified && data.hasKey("response")
-               && data["response"].isArray();
+               && data["response"].isArray()
+               && (!data.hasKey("next") || data["next"].isString())
+               && (!data.hasKey("journal") || (data["journal"].isString() && data.hasKey("generation")
+                                               && data["generation"].isNumber()))
+               && (!data.hasKey("since") || (data["since"].isNumber() && data.hasKey("journal")
+                                             && data.hasKey("removed") && data["removed"].isArray()));
+    }
+    if (type == "listSinceRequest") {
+        return verified && data.hasKey("journal") && data["journal"].isString()
+               && data.hasKey("generation") && data["generation"].isNumber();
     }
     if (type == "pullRequest") {
         return verified && data.hasKey("request")
@@ -245,6 +1261,14 @@ bool verifyJSONPacket(const json &data) {
     if (type == "leave") {
         return verified;
     }
+    if (type == "manifestRequest") {
+        return verified && data.hasKey("request")
+               && data["request"].isArray();
+    }
+    if (type == "manifestResponse") {
+        return verified && data.hasKey("response")
+               && data["response"].isArray();
+    }
 
     return false;
 }
@@ -253,144 +1277,114 @@ bool verifyJSONPacket(const json &data, const string &type) {
     return verifyJSONPacket(data) && data["type"].getString() == type;
 }
 
-// base64 uses an 8-bit character to store 6 "raw" bits. 
-// These sync up at the least common multiple, 24 bits (every 3 bytes of input)
-// Ensure a contiguous representation for bit manipulation
-struct fourchar {
-    char padding;
-    char char1;
-    char char2;
-    char char3;
-};
-union Bitmanip {
-    fourchar f;
-    uint32_t i;
-};
-
-
-string base64Encode(const std::vector<char> &inputBuffer) {
-    stringstream output;
-    uint8_t index;
-    Bitmanip b;
-
-    for (size_t i = 0; i + 2 < inputBuffer.size(); i += 3) {
-        // extract 3 bytes from the vector
-        b.f.padding = (char) 0x00;
-        b.f.char1 = inputBuffer[i];
-        b.f.char2 = inputBuffer[i + 1];
-        b.f.char3 = inputBuffer[i + 2];
-        b.i = htonl(b.i);
-
-        index = static_cast<uint8_t>((b.i & 0x00FC0000) >> 18);
-        output << BASE64_CHARS[index];
-        index = static_cast<uint8_t>((b.i & 0x0003F000) >> 12);
-        output << BASE64_CHARS[index];
-        index = static_cast<uint8_t>((b.i & 0x00000FC0) >> 6);
-        output << BASE64_CHARS[index];
-        index = static_cast<uint8_t>((b.i & 0x0000003F) >> 0);
-        output << BASE64_CHARS[index];
-    }
-
-    // Get the remaining 1 or 2 bytes
-    memset(&b, 0, 3);
-    switch (inputBuffer.size() % 3) {
-        case 1:
-            b.f.char1 = inputBuffer[inputBuffer.size() - 1];
-            b.i = htonl(b.i);
-            index = static_cast<uint8_t>((b.i & 0x00FC0000) >> 18);
-            output << BASE64_CHARS[index];
-            index = static_cast<uint8_t>((b.i & 0x00030000) >> 12);
-            output << BASE64_CHARS[index];
-            output << BASE64_PAD_CHAR;
-            output << BASE64_PAD_CHAR;
-            break;
-        case 2:
-            b.f.char1 = inputBuffer[inputBuffer.size() - 2];
-            b.f.char2 = inputBuffer[inputBuffer.size() - 1];
-            b.i = htonl(b.i);
-            index = static_cast<uint8_t>((b.i & 0x00FC0000) >> 18);
-            output << BASE64_CHARS[index];
-            index = static_cast<uint8_t>((b.i & 0x0003F000) >> 12);
-            output << BASE64_CHARS[index];
-            index = static_cast<uint8_t>((b.i & 0x00000F00) >> 6);
-            output << BASE64_CHARS[index];
-            output << BASE64_PAD_CHAR;
-            break;
-        default:
-            break;
-    }
-    return output.str();
+// This is just so I can comment out all the debug statements at once
+void debug(const std::string &debugMessage) {
+    //std::cout << debugMessage << std::endl;
 }
 
-string base64Decode(const string &inputString) {
-    vector<char> resultVector;
-    Bitmanip b_in;
-    Bitmanip b_out;
+// Messages are only stringified if they're actually printed, since they can hold whole files
+void debug(const std::string &debugMessage, const json &data) {
+    //std::cout << debugMessage << data << std::endl;
+}
 
-    size_t i = 0;
-    for (; i + 3 < inputString.size(); i += 4) {
-        // Extract four bytes from the input string
-        b_in.f.padding = inputString[i + 0];
-        b_in.f.char1 = inputString[i + 1];
-        b_in.f.char2 = inputString[i + 2];
-        b_in.f.char3 = inputString[i + 3];
-        memset(&b_out, 0, 4);
+void writeBase64ToFile(const std::string &path, const std::string &data) {
+    string outString = base64Decode(data);
+    std::ofstream fileWriter(path, std::ios::binary);
+    fileWriter.write(outString.data(), outString.size());
+    fileWriter.close();
+}
 
-        b_out.i |= BASE64_REVERSE_MAP[static_cast<uint8_t>(b_in.f.padding)] << 18;
-        b_out.i |= BASE64_REVERSE_MAP[static_cast<uint8_t>(b_in.f.char1)] << 12;
-        b_out.i |= BASE64_REVERSE_MAP[static_cast<uint8_t>(b_in.f.char2)] << 6;
-        b_out.i |= BASE64_REVERSE_MAP[static_cast<uint8_t>(b_in.f.char3)];
+void writeFileAsBase64(const std::string &path, JSONSink &sink) {
+    writeFilesAsBase64(vector<string>{path}, sink);
+}
 
-        // Reverse byte order
-        b_out.i = htonl(b_out.i);
+/*
+ * Base64 encode files, one after another as if they were one file, into sink a block at a time. Blocks are a multiple
+ * of 3 bytes so no padding lands mid-stream; a block is only encoded short at the very end.
+ */
+void writeFilesAsBase64(const std::vector<std::string> &paths, JSONSink &sink) {
+    const size_t blockSize = 3 * 16 * 1024;
+    vector<char> block(blockSize);
+    vector<char> encoded(base64EncodedLength(blockSize));
+    size_t filled = 0;
 
-        resultVector.emplace_back(b_out.f.char1);
-        if (b_in.f.char2 != '=') {
-            resultVector.emplace_back(b_out.f.char2);
-        }
-        if (b_in.f.char3 != '=') {
-            resultVector.emplace_back(b_out.f.char3);
+    for (const auto &path : paths) {
+        ifstream input(path.c_str(), ios::binary);
+        while (input) {
+            input.read(block.data() + filled, blockSize - filled);
+            filled += static_cast<size_t>(input.gcount());
+            if (filled == blockSize) {
+                sink.write(encoded.data(), base64Encode(block.data(), filled, encoded.data()));
+                filled = 0;
+            }
         }
     }
-
-    return string(resultVector.begin(), resultVector.end());
+    if (filled > 0) {
+        sink.write(encoded.data(), base64Encode(block.data(), filled, encoded.data()));
+    }
 }
 
-// This is just so I can comment out all the debug statements at once
-void debug(const std::string &debugMessage) {
-    //std::cout << debugMessage << std::endl;
+// Create a new empty file in directory that won't be listed, for receiving into before it gets its real name
+string createTempFile(const string &directory) {
+    string pathTemplate = directory + INTERNAL_FILE_PREFIX + "Partial.XXXXXX";
+    vector<char> path(pathTemplate.begin(), pathTemplate.end());
+    path.push_back('\0');
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        throw std::runtime_error("Could not create a temporary file in " + directory);
+    }
+    close(fd);
+    return string(path.data());
 }
 
-void writeBase64ToFile(const std::string &path, const std::string &data) {
-    string outString = base64Decode(data);
-    std::ofstream fileWriter(path, std::ios::binary);
-    for (auto d : outString) {
-        fileWriter.write(&d, sizeof(char));
+/*
+ * Move a received file from its temporary path into directory under filename, or the first name filenameIncrement()
+ * gives that is free. The file is linked into place rather than renamed, so nothing already there is ever replaced,
+ * even a file put there since existingFilenames was listed. Names that aren't plain filenames are refused. Returns the
+ * name used, or an empty string, in which case the temporary file is deleted.
+ */
+string moveIntoPlace(const string &tempPath, const string &directory, const string &filename,
+                     set<string> &existingFilenames) {
+    string dir = directory.back() == '/' ? directory : directory + '/';
+    while (isListedFilename(filename)) {
+        string newFilename = filenameIncrement(filename, existingFilenames);
+        existingFilenames.insert(newFilename);
+        if (link(tempPath.c_str(), (dir + newFilename).c_str()) == 0) {
+            remove(tempPath.c_str());
+            return newFilename;
+        }
+        if (errno != EEXIST) {
+            perror("Could not move received file into place");
+            break;
+        }
     }
-    fileWriter.close();
+    remove(tempPath.c_str());
+    return string();
 }
 
 string filenameIncrement(const string &filename, const set<string> &existingFilenames) {
     if (existingFilenames.find(filename) != existingFilenames.end()) {
-        string res(filename);
         size_t periodPos = filename.find_first_of('.');
-        if (periodPos != string::npos) {
-            int i = 1;
-            char c[2];
-            res.insert(periodPos, " (1)");
-            while (existingFilenames.find(res) != existingFilenames.end() && i > 0) {
-                snprintf(c, 2, "%d", ++i);
-                res[periodPos + 2] = c[0];
-            }
-        } else {
-            res.append(" (1)");
+        if (periodPos == string::npos) {
+            periodPos = filename.size();
         }
+        string res;
+        int i = 0;
+        do {
+            res = filename.substr(0, periodPos) + " (" + std::to_string(++i) + ")" + filename.substr(periodPos);
+        } while (existingFilenames.find(res) != existingFilenames.end());
         return res;
     } else {
         return filename;
     }
 }
 
+// Only plain names of files in a directory are accepted from the other side; anything else could reach outside it
+bool isListedFilename(const string &filename) {
+    return !filename.empty() && filename.find('/') == string::npos && filename != "." && filename != ".." &&
+           filename.compare(0, INTERNAL_FILE_PREFIX.size(), INTERNAL_FILE_PREFIX) != 0;
+}
+
 string getPeerStringFromSocket(int sock) {
     struct sockaddr_in clientSockaddr;
     socklen_t addrLen = sizeof(clientSockaddr);
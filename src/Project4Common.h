@@ -12,43 +12,69 @@
 #include <unistd.h>     /* for close() */
 #include <sys/types.h>
 #include <sys/time.h>  // FD_SET, FD_ISSET, FD_macros
+#include <sys/uio.h>   // writev()
+#include <poll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <vector>
 #include <algorithm>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <fstream>
 #include <iterator>
 #include <exception>
 #include <set>
 #include <map>
+#include <deque>
+#include <functional>
 
 #include "HappyPathJSON.h"
 #include "CRC32.h"
+#include "Base64.h"
+#include "BinaryMessage.h"
+#include "ChecksumIndex.h"
+#include "Compression.h"
 
 using json = JSON;
 
 const double VERSION = 1.0;
-const std::string BASE64_CHARS = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-const char BASE64_PAD_CHAR = '=';
-const uint8_t BASE64_REVERSE_MAP[256] = { // 16x16 unsigned chars. Base64 ASCII subset
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 62, 0, 0, 0, 63,
-        52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 0, 0, 0, 0, 0, 0,
-        0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
-        15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 0, 0, 0, 0, 0,
-        0, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
-        41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+// Version 2 sends file bodies as chunk frames after the JSON message instead of as base64 inside it
+const double STREAMING_VERSION = 2.0;
+const size_t FILE_CHUNK_SIZE = 64 * 1024;
+// The most files a listResponse holds when the listing is sent a page at a time
+const size_t LIST_PAGE_SIZE = 5000;
+// A chunk frame whose length word has this bit set carries no data; the rest of the word is the index of a chunk of
+// the receiver's base file to copy instead
+const uint32_t COPY_FRAME_FLAG = 0x80000000;
+// A frame starting with this word holds a compressed block of the file: the compressed length and the block's own
+// length follow, 4 bytes each, then the compressed data. It reads as a copy of a chunk index that no base can have,
+// and is only sent from version 6.
+const uint32_t COMPRESSED_FRAME = 0xFFFFFFFF;
+
+// The file a delta is made against, on the receiving side, and the chunks it splits into
+struct DeltaBase {
+    std::string path;
+    std::vector<Chunk> chunks;
+    std::vector<std::string> chunkPaths;  // if set, each chunk is read from its own file instead of from path
+};
+
+// What the data of a file received by receiveFileChunks() took on the wire, so the effect of compression can be shown
+struct TransferStats {
+    uint64_t fileBytes;  // data received, not counting chunks copied from a base
+    uint64_t wireBytes;  // the frames that data came in
+    bool compressed;     // whether any of it came compressed
+};
+
+// Somewhere for receiveFileChunks() to put a file's data
+class FileSink {
+public:
+    virtual ~FileSink() = default;
+
+    virtual bool write(const char *data, size_t length) = 0;
+
+    // Returns false if any write failed
+    virtual bool finish() = 0;
 };
 
 class InputParser {
@@ -69,10 +95,14 @@ class MusicData {
 public:
     MusicData(const std::string &path);
 
+    MusicData(const std::string &path, const std::string &checksum);
+
     std::string getFilename();
 
     std::string getChecksum();
 
+    std::string getPath();
+
     json getAsJSON(bool withData);
 
 private:
@@ -95,30 +125,211 @@ std::string getFilename(const std::string &path);
 
 std::vector<MusicData> list(const std::string &directory);
 
+std::vector<MusicData> list(const std::string &directory, const std::string &after, size_t count);
+
+bool findFile(const std::string &directory, const std::string &filename, std::string &checksum);
+
+void runInParallel(size_t count, const std::function<void(size_t)> &work);
+
 in_addr_t hostOrIPToInet(const std::string &host);
 
-std::string receiveUntilByteEquals(int sock, char eq);
+class SocketWriter;
 
-void sendToSocket(int socket, const std::string &data);
+class SocketReader {
+public:
+    enum ReceiveStatus {
+        MessageReady,
+        WouldBlock,
+        Closed
+    };
 
-void sendToSocket(int socket, const json &data);
+    explicit SocketReader(int sock);
 
-bool verifyJSONPacket(const json &data);
+    std::string receiveUntilByteEquals(char eq);
 
-bool verifyJSONPacket(const json &data, const std::string &type);
+    ReceiveStatus receiveAvailable(char eq);
+
+    bool receiveExactly(char *dest, size_t length);
+
+    bool hasBufferedMessage(char eq);
+
+    bool nextIsFrame();
+
+    bool receiveFrame(FrameHeader &header, std::string &body);
+
+    void drainWhileWaiting(SocketWriter *writer);
+
+private:
+    ssize_t receiveIntoBuffer();
+
+    bool fillBuffer();
+
+    bool waitForData();
+
+    int sock;
+    std::vector<char> buffer;
+    size_t readPos;
+    size_t writePos;
+    size_t searchPos;  // everything from readPos up to here is known not to contain the delimiter
+    SocketWriter *drainWriter;
+};
+
+/*
+ * Outbound queue for a socket. Data is queued without copying it into one buffer, and written with writev() as the
+ * socket accepts it, so short writes and non-blocking sockets are handled. Ranges of files can be queued too; they
+ * are sent with sendfile() so file bodies go from the page cache to the socket without passing through user space.
+ * Ranges to be compressed are read and compressed a block at a time instead, as each block comes up to be sent.
+ */
+class SocketWriter {
+public:
+    enum FlushStatus {
+        Flushed,
+        WouldBlock,
+        Failed
+    };
+
+    explicit SocketWriter(int sock);
+
+    SocketWriter(const SocketWriter &) = delete;
+
+    SocketWriter &operator=(const SocketWriter &) = delete;
+
+    ~SocketWriter();
+
+    void queue(std::string data);
+
+    void queueMessage(std::string payload);
+
+    void queueFile(int fd, off_t offset, size_t length);
+
+    void queueFilePath(std::string path, off_t offset, size_t length);
+
+    void queueCompressedFile(std::string path, off_t offset, size_t length);
+
+    FlushStatus flush();
+
+    bool flushBelow(size_t limit);
+
+    size_t pending() const;
+
+    size_t buffered() const;
+
+private:
+    struct Piece {
+        std::string data;
+        int fd;         // -1 unless this piece comes from a file, which the writer then owns
+        off_t offset;   // where the unsent part starts, in data or in the file
+        size_t length;  // how much is left to send
+        std::string path;  // a file to open once this piece is reached, if it doesn't have fd yet
+        bool compress;     // whether the file is sent as frames, compressed a block at a time, rather than as it is
+
+        bool isFile() const { return this->fd >= 0 || !this->path.empty(); }
 
-std::string base64Encode(const std::vector<char> &inputBuffer);
+        size_t memoryUsed() const { return sizeof(Piece) + this->data.size() + this->path.size(); }
+    };
 
-std::string base64Decode(const std::string &inputString);
+    ssize_t sendFilePiece(const Piece &piece);
+
+    bool compressNextBlock();
+
+    void consume(size_t bytesSent);
+
+    int sock;
+    std::deque<Piece> pieces;
+    size_t pendingBytes;
+    size_t bufferedBytes;
+};
+
+// Writes JSON straight into a SocketWriter's queue, in pieces of about FILE_CHUNK_SIZE
+class SocketWriterSink : public JSONSink {
+public:
+    SocketWriterSink(SocketWriter &writer, size_t flushAbove);
+
+    void write(const char *data, size_t length) override;
+
+    using JSONSink::write;
+
+    bool finish();
+
+private:
+    void queueBuffer();
+
+    SocketWriter &writer;
+    size_t flushAbove;  // wait for the socket whenever more than this is queued
+    std::string buffer;
+    bool failed;
+};
+
+bool waitForSocket(int sock, short events);
+
+bool setNonBlocking(int sock);
+
+bool sendToSocket(SocketWriter &writer, const json &data);
+
+bool sendToSocket(int socket, std::string data);
+
+bool sendToSocket(int socket, const json &data);
+
+json receiveMessage(SocketReader &reader);
+
+bool sendFileChunks(SocketWriter &writer, const std::string &path, bool compress);
+
+bool sendFileChunks(int socket, const std::string &path, bool compress);
+
+bool sendFileDelta(SocketWriter &writer, const std::string &path, const std::vector<Chunk> &baseChunks, bool compress);
+
+bool sendFileDelta(int socket, const std::string &path, const std::vector<Chunk> &baseChunks, bool compress);
+
+bool receiveFileChunks(SocketReader &reader, const std::string &path, std::string &checksum);
+
+bool receiveFileChunks(SocketReader &reader, const std::string &path, std::string &checksum, const DeltaBase *base);
+
+bool receiveFileChunks(SocketReader &reader, const std::string &path, std::string &checksum, const DeltaBase *base,
+                       TransferStats *stats);
+
+bool receiveFileChunks(SocketReader &reader, FileSink &sink, std::string &checksum, const DeltaBase *base);
+
+bool receiveFileChunks(SocketReader &reader, FileSink &sink, std::string &checksum, const DeltaBase *base,
+                       TransferStats *stats);
+
+std::string describeCompression(const TransferStats &stats);
+
+bool sendChunkedFile(SocketWriter &writer, const std::vector<Chunk> &chunks, const std::vector<std::string> &chunkPaths,
+                     const std::vector<Chunk> &baseChunks, bool compress);
+
+bool discardFileChunks(SocketReader &reader);
+
+bool isSupportedVersion(double version);
+
+bool isStreamingVersion(double version);
+
+double negotiateVersion(const json &listResponse);
+
+bool verifyJSONPacket(const json &data);
+
+bool verifyJSONPacket(const json &data, const std::string &type);
 
 void debug(const std::string &debugMessage);
 
+void debug(const std::string &debugMessage, const json &data);
+
 std::string filenameIncrement(const std::string &filename, const std::set<std::string> &existingFilenames);
 
+bool isListedFilename(const std::string &filename);
+
 std::string getPeerStringFromSocket(int sock);
 
 std::string prettyListFiles(const json &message);
 
 void writeBase64ToFile(const std::string &path, const std::string &data);
 
+void writeFileAsBase64(const std::string &path, JSONSink &sink);
+
+void writeFilesAsBase64(const std::vector<std::string> &paths, JSONSink &sink);
+
+std::string createTempFile(const std::string &directory);
+
+std::string moveIntoPlace(const std::string &tempPath, const std::string &directory, const std::string &filename,
+                          std::set<std::string> &existingFilenames);
+
 #endif
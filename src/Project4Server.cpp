@@ -1,6 +1,18 @@
 #include "Project4Common.h"
+#include "ThreadPool.h"
+#include "DirectoryLock.h"
+#include "ChunkStore.h"
+#include "DirectoryWatcher.h"
 #include <chrono>
 #include <ctime>
+#include <mutex>
+#include <memory>
+
+// Linux servers wait on epoll; everything else (or a build with SELECT=1) falls back to select()
+#if defined(__linux__) && !defined(USE_SELECT)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 using std::string;
 using std::set;
@@ -12,11 +24,17 @@ using std::cout;
 using std::endl;
 
 void printHelp(char **argv) {
-    cout << "Usage: " << *argv << " -p listeningPort [-d directory]" << endl;
+    cout << "Usage: " << *argv << " -p listeningPort [-d directory] [-t workerThreads] [-c [-i] | -e]" << endl;
+    cout << "  -t defaults to the number of cores; 0 handles every request on the listening thread" << endl;
+    cout << "  -c keeps files in a deduplicating chunk store instead of as plain files in the directory" << endl;
+    cout << "  -i with -c, moves the plain files already in the directory into the store, deleting them" << endl;
+    cout << "  -e moves every file in the chunk store back into the directory as plain files" << endl;
     exit(1);
 }
 
 void log(const string &logMessage, const string &logFilepath) {
+    static std::mutex logMutex;  // requests are logged from every worker thread
+    std::lock_guard<std::mutex> guard(logMutex);
     std::time_t currentTime = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
     char *timeStr = std::ctime(&currentTime);
     timeStr[strlen(timeStr) - 1] = '\0';  // drop trailing newline
@@ -28,208 +46,703 @@ void log(const string &logMessage, const string &logFilepath) {
     fileWriter.close();
 }
 
-void doListResponse(int sock, const string &directory) {
-    auto files = list(directory);
+ChunkStore *chunkStore = nullptr;  // set with -c; otherwise files are kept as they are in the directory
+DirectoryWatcher *watcher = nullptr;  // keeps the directory's listing in memory, where inotify is available
+
+/*
+ * A client that pipelines its requests has its next request read while earlier responses are still going out, as
+ * long as they hold no more than this much memory. File bodies are queued as file ranges and cost next to nothing.
+ */
+const size_t PIPELINE_QUEUE_LIMIT = 1024 * 1024;
+
+// A response repeats its request's ID, so a client with many requests in flight can tell which one it answers
+void copyRequestId(const json &request, json &response) {
+    if (request.hasKey("id")) {
+        response["id"] = request["id"].getNumber();
+    }
+}
+
+vector<MusicData> listFiles(const string &directory) {
+    DirectoryLock lock(directory, DirectoryLock::Shared);
+    if (chunkStore != nullptr) {
+        return chunkStore->list();
+    }
+    return watcher != nullptr ? watcher->list() : list(directory);
+}
+
+// Look up one file's current checksum, without listing the whole directory
+bool lookupFile(const string &directory, const string &filename, string &checksum) {
+    if (!isListedFilename(filename)) {
+        return false;
+    }
+    DirectoryLock lock(directory, DirectoryLock::Shared);
+    if (chunkStore != nullptr) {
+        return chunkStore->lookup(filename, checksum);
+    }
+    return watcher != nullptr ? watcher->lookup(filename, checksum) : findFile(directory, filename, checksum);
+}
+
+// Find the file that a pushed delta was made against
+bool findBase(const string &directory, const string &filename, DeltaBase &base) {
+    if (!isListedFilename(filename)) {
+        return false;
+    }
+    if (chunkStore != nullptr) {
+        return chunkStore->find(filename, base.chunks, base.chunkPaths);
+    }
+    base.path = directory + filename;
+    return chunkFile(base.path, base.chunks);
+}
+
+// One page of the listing, in order of name
+vector<MusicData> listFiles(const string &directory, const string &after, size_t count) {
+    DirectoryLock lock(directory, DirectoryLock::Shared);
+    if (chunkStore != nullptr) {
+        return chunkStore->list(after, count);
+    }
+    return watcher != nullptr ? watcher->list(after, count) : list(directory, after, count);
+}
 
-    vector<json> jsonFiles(files.size());
+// Where the listing's change journal is up to. Returns false if it has none, as a directory without a watcher doesn't.
+bool listingGeneration(string &journal, uint64_t &generation) {
+    if (chunkStore != nullptr) {
+        journal = chunkStore->journalId();
+        generation = chunkStore->generation();
+        return true;
+    }
+    if (watcher != nullptr) {
+        journal = watcher->journalId();
+        generation = watcher->generation();
+        return true;
+    }
+    return false;
+}
+
+// What changed in the listing after a generation of the given journal, if it can say
+bool listChanges(const string &directory, const string &journal, uint64_t since, ListingChanges &changes) {
+    DirectoryLock lock(directory, DirectoryLock::Shared);
+    if (chunkStore != nullptr) {
+        return journal == chunkStore->journalId() && chunkStore->changedSince(since, LIST_PAGE_SIZE, changes);
+    }
+    if (watcher != nullptr) {
+        return journal == watcher->journalId() && watcher->changedSince(since, LIST_PAGE_SIZE, changes);
+    }
+    return false;
+}
+
+/*
+ * A client that can take the listing a page at a time asks for no more than "limit" files, listing from after the
+ * filename in "after". If there are more, the response's "next" says where the next page starts. From version 8 the
+ * first page also says which journal generation the listing is from, for the client to ask for changes since.
+ */
+void doListResponse(SocketWriter &writer, const string &directory, const json &listRequest) {
+    double offered = listRequest["version"].getNumber();
+    if (listRequest.hasKey("maxVersion") && listRequest["maxVersion"].isNumber()) {
+        offered = std::max(offered, listRequest["maxVersion"].getNumber());
+    }
+    bool paged = offered >= PAGED_LIST_VERSION && listRequest.hasKey("limit");
+
+    // Taken before listing, so that anything that changes while the listing is read is sent again next time
+    string journal;
+    uint64_t generation = 0;
+    bool journalled = paged && offered >= LIST_SINCE_VERSION && !listRequest.hasKey("after") &&
+                      listingGeneration(journal, generation);
+
+    vector<MusicData> files;
+    string next;
+    if (paged) {
+        double requested = std::max(listRequest["limit"].getNumber(), 1.0);
+        size_t limit = static_cast<size_t>(std::min(requested, static_cast<double>(LIST_PAGE_SIZE)));
+        string after = listRequest.hasKey("after") ? listRequest["after"].getString() : string();
+        // One more than the page holds says whether there is another page
+        files = listFiles(directory, after, limit + 1);
+        if (files.size() > limit) {
+            files.pop_back();
+            next = files.back().getFilename();
+        }
+    } else {
+        files = listFiles(directory);
+    }
+
+    vector<json> jsonFiles;
+    jsonFiles.reserve(files.size());
     for (auto f : files) {
         jsonFiles.push_back(f.getAsJSON(false));
     }
 
+    // Clients that can read a binary listResponse get one; anything else gets version 1 so every client can read it
+    double version = paged ? std::min(offered, LIST_SINCE_VERSION)
+                           : offered >= BINARY_VERSION ? BINARY_VERSION : VERSION;
+
     json listResponsePacket;
-    listResponsePacket["version"] = VERSION;
+    listResponsePacket["version"] = version;
+    listResponsePacket["maxVersion"] = LIST_SINCE_VERSION;
     listResponsePacket["type"] = JSON("listResponse", true);
     listResponsePacket["response"] = jsonFiles;
-    sendToSocket(sock, listResponsePacket);
+    if (!next.empty()) {
+        listResponsePacket["next"] = JSON(next, true);
+    }
+    if (journalled) {
+        listResponsePacket["journal"] = JSON(journal, true);
+        listResponsePacket["generation"] = static_cast<double>(generation);
+    }
+    copyRequestId(listRequest, listResponsePacket);
+    if (!sendToSocket(writer, listResponsePacket)) {
+        throw std::runtime_error("Unable to send listResponse");
+    }
 }
 
-void doPullResponse(int sock, const string &directory, const json &pullRequest) {
+void doPullResponse(SocketWriter &writer, const string &directory, const json &pullRequest) {
+    bool streaming = isStreamingVersion(pullRequest["version"].getNumber());
+    bool compress = pullRequest["version"].getNumber() >= COMPRESSION_VERSION;
 
     json pullResponse;
-    pullResponse["version"] = VERSION;
+    pullResponse["version"] = pullRequest["version"].getNumber();
     pullResponse["type"] = JSON("pullResponse", true);
     json emptyArr;
     emptyArr.makeArray();
     pullResponse["response"] = emptyArr;
+    copyRequestId(pullRequest, pullResponse);
 
-    vector<MusicData> musicList = list(directory);
+    vector<MusicData> streamFiles;
+    vector<vector<Chunk>> streamBases;  // the client's chunks of its own file of the same name, if it sent them
     for (auto reqItem : pullRequest["request"]) {
-        for (MusicData datum : musicList) {
-            if (datum.getFilename() == reqItem["filename"].getString() &&
-                datum.getChecksum() == reqItem["checksum"].getString()) {
-                pullResponse["response"].push(datum.getAsJSON(true));
+        string filename = reqItem["filename"].getString();
+        string checksum;
+        if (lookupFile(directory, filename, checksum) && checksum == reqItem["checksum"].getString()) {
+            MusicData datum(directory + filename, checksum);
+            json entry = datum.getAsJSON(!streaming && chunkStore == nullptr);
+            if (!streaming && chunkStore != nullptr) {
+                vector<Chunk> chunks;
+                vector<string> paths;
+                chunkStore->find(datum.getFilename(), chunks, paths);
+                entry["data"] = JSON(JSON::StringWriter([paths](JSONSink &sink) {
+                    writeFilesAsBase64(paths, sink);
+                }));
             }
+            pullResponse["response"].push(std::move(entry));
+            streamFiles.push_back(datum);
+            streamBases.push_back(reqItem.hasKey("chunks") ? chunksFromJSON(reqItem["chunks"]) : vector<Chunk>());
         }
     }
 
-    sendToSocket(sock, pullResponse);
+    if (!sendToSocket(writer, pullResponse)) {
+        throw std::runtime_error("Unable to send pullResponse");
+    }
+    if (streaming) {
+        // File bodies follow the response in the same order as its entries
+        for (size_t i = 0; i < streamFiles.size(); i++) {
+            bool sent;
+            if (chunkStore != nullptr) {
+                vector<Chunk> chunks;
+                vector<string> paths;
+                sent = chunkStore->find(streamFiles[i].getFilename(), chunks, paths);
+                // A stored file is judged by a sample of its first chunk
+                bool compressFile = compress && !paths.empty() &&
+                                    isWorthCompressing(streamFiles[i].getFilename(), paths[0]);
+                sent = sent && sendChunkedFile(writer, chunks, paths, streamBases[i], compressFile);
+            } else if (streamBases[i].empty()) {
+                sent = sendFileChunks(writer, streamFiles[i].getPath(), compress);
+            } else {
+                sent = sendFileDelta(writer, streamFiles[i].getPath(), streamBases[i], compress);
+            }
+            if (!sent) {
+                throw std::runtime_error("Unable to stream " + streamFiles[i].getFilename());
+            }
+        }
+    }
 }
 
-void doPushResponse(int sock, const string &directory, const json &pushRequest) {
+/*
+ * Send the chunks of each requested file, so the client can push a changed copy of it as a delta. Files are matched
+ * by name and checksum, like a pull, and ones that aren't found are left out.
+ */
+void doManifestResponse(SocketWriter &writer, const string &directory, const json &manifestRequest) {
+    json manifestResponse;
+    manifestResponse["version"] = manifestRequest["version"].getNumber();
+    manifestResponse["type"] = JSON("manifestResponse", true);
+    json emptyArr;
+    emptyArr.makeArray();
+    manifestResponse["response"] = emptyArr;
+    copyRequestId(manifestRequest, manifestResponse);
+
+    for (auto reqItem : manifestRequest["request"]) {
+        string filename = reqItem["filename"].getString();
+        string checksum;
+        DeltaBase base;
+        if (lookupFile(directory, filename, checksum) && checksum == reqItem["checksum"].getString() &&
+            findBase(directory, filename, base)) {
+            json entry = MusicData(directory + filename, checksum).getAsJSON(false);
+            entry["chunks"] = chunksToJSON(base.chunks);
+            manifestResponse["response"].push(std::move(entry));
+        }
+    }
+
+    if (!sendToSocket(writer, manifestResponse)) {
+        throw std::runtime_error("Unable to send manifestResponse");
+    }
+}
+
+/*
+ * Every file is received into a temporary file first, or straight into the chunk store, without holding any lock.
+ * Only once they've all arrived is the directory locked to pick each file's final name and move it into place, so
+ * that concurrent pushes can't pick the same name and a slow client never holds up anyone else.
+ */
+void doPushResponse(SocketReader &reader, SocketWriter &writer, const string &directory, const json &pushRequest,
+                    const string &logFilepath) {
+    bool streaming = isStreamingVersion(pushRequest["version"].getNumber());
+
     json pushResponse;
-    pushResponse["version"] = VERSION;
+    pushResponse["version"] = pushRequest["version"].getNumber();
     pushResponse["type"] = JSON("pushResponse", true);
     json emptyArr;
     emptyArr.makeArray();
     pushResponse["response"] = emptyArr;
+    copyRequestId(pushRequest, pushResponse);
 
-    vector<string> filepaths = directoryFileListing(directory);
+    vector<string> tempPaths;
+    vector<std::unique_ptr<ChunkStore::FileWriter>> storeWriters;  // uncommitted files are released when these go
+    vector<string> checksums;
+    for (auto file : pushRequest["request"]) {
+        string tempPath;
+        std::unique_ptr<ChunkStore::FileWriter> storeWriter;
+        if (chunkStore != nullptr) {
+            storeWriter.reset(new ChunkStore::FileWriter(*chunkStore));
+        } else {
+            tempPath = createTempFile(directory);
+        }
+        string checksum;
+        if (streaming) {
+            // A body sent as a delta copies chunks from the file named as its base
+            DeltaBase base;
+            bool hasBase = file.hasKey("base") && findBase(directory, file["base"].getString(), base);
+            // Bodies follow the request in the same order as its entries
+            TransferStats stats{0, 0, false};
+            bool received = storeWriter ? receiveFileChunks(reader, *storeWriter, checksum, hasBase ? &base : nullptr,
+                                                            &stats)
+                                        : receiveFileChunks(reader, tempPath, checksum, hasBase ? &base : nullptr,
+                                                            &stats);
+            if (!received) {
+                remove(tempPath.c_str());
+                for (const auto &path : tempPaths) {
+                    remove(path.c_str());
+                }
+                throw std::runtime_error("Client stopped sending " + file["filename"].getString());
+            }
+            if (stats.compressed) {
+                log("Received " + file["filename"].getString() + describeCompression(stats), logFilepath);
+            }
+        } else if (storeWriter) {
+            string data = base64Decode(file["data"].getString());
+            CRC32State crc;
+            crc.update(data.data(), data.size());
+            checksum = (storeWriter->write(data.data(), data.size()) && storeWriter->finish()) ? crc.toString()
+                                                                                              : string();
+        } else {
+            writeBase64ToFile(tempPath, file["data"].getString());
+            checksum = computeCRC(tempPath);
+        }
+        tempPaths.push_back(tempPath);
+        storeWriters.push_back(std::move(storeWriter));
+        checksums.push_back(checksum);
+    }
+
+    DirectoryLock lock(directory, DirectoryLock::Exclusive);
     set<string> filenames;
-    for (string path : filepaths) {
-        filenames.insert(getFilename(path));
+    if (chunkStore != nullptr) {
+        filenames = chunkStore->filenames();
+    } else {
+        for (string path : directoryFileListing(directory)) {
+            filenames.insert(getFilename(path));
+        }
     }
+    unsigned int i = 0;
     for (auto file : pushRequest["request"]) {
-        string filename = directory + filenameIncrement(file["filename"].getString(), filenames);
-        writeBase64ToFile(filename, file["data"].getString());
-        MusicData d(filename);
-        if (d.getChecksum() != file["checksum"].getString()) {
+        // A name that isn't a plain filename could replace one of our own files or reach outside the directory, so
+        // the file is dropped and left out of the response
+        if (!isListedFilename(file["filename"].getString())) {
+            std::cerr << "Refusing pushed file named " << file["filename"].getString() << endl;
+            remove(tempPaths[i++].c_str());
+            continue;
+        }
+        string newFilename = filenameIncrement(file["filename"].getString(), filenames);
+        if (checksums[i] != file["checksum"].getString()) {
             std::cerr << "Checksum mismatch, probable write or decode error" << endl;
             // Delete the file
-            remove(filename.c_str());
+            remove(tempPaths[i].c_str());
+        } else if (chunkStore != nullptr) {
+            if (storeWriters[i]->commit(newFilename, checksums[i])) {
+                filenames.insert(newFilename);
+            } else {
+                std::cerr << "Could not add " << newFilename << " to the chunk store" << endl;
+            }
+        } else {
+            newFilename = moveIntoPlace(tempPaths[i], directory, file["filename"].getString(), filenames);
+            if (newFilename.empty()) {
+                i++;
+                continue;
+            }
+            if (watcher != nullptr) {
+                watcher->update(newFilename, checksums[i]);
+            }
         }
 
-        pushResponse["response"].push(d.getAsJSON(false));
+        pushResponse["response"].push(MusicData(directory + newFilename, checksums[i]).getAsJSON(false));
+        i++;
+    }
+    if (!sendToSocket(writer, pushResponse)) {
+        throw std::runtime_error("Unable to send pushResponse");
     }
-    sendToSocket(sock, pushResponse);
 }
 
-void closeSocket(int sock, int* clientSockets, int clientSocketIndex){
-    clientSockets[clientSocketIndex] = 0;
+/*
+ * A connected client. Only one thread at a time ever handles a given connection. Responses, including streamed file
+ * bodies, are queued on its writer and the event loop sends whatever the client hasn't read yet, so a worker never
+ * waits on a slow client.
+ */
+struct Connection {
+    explicit Connection(int sock) : sock(sock), reader(sock), writer(sock) {
+        // Pulled files keep going out while a pushed file is being received
+        this->reader.drainWhileWaiting(&this->writer);
+    }
+
+    int sock;
+    SocketReader reader;
+    SocketWriter writer;
+    bool busy = false;
+};
+
+typedef std::map<int, std::unique_ptr<Connection>> ConnectionMap;
+
+void closeConnection(int sock, ConnectionMap &connections) {
+    connections.erase(sock);
     close(sock);
 }
 
-void handleClient(int sock, const string &directory, int* client_socket, int client_sock_close_index,
-                  const string &logFilepath) {
-    auto query = receiveUntilByteEquals(sock, '\n');
-    try {
-        auto queryJ = json(query);  // will throw an exception if invalid JSON received
-        debug("Received: " + queryJ.stringify());
-
-        if (verifyJSONPacket(queryJ)) {
-            string type = queryJ["type"].getString();
-
-            if (type == "listRequest") {
-                log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
-                        string(" requested a list of files")), logFilepath);
-                doListResponse(sock, directory);
-            } else if (type == "pullRequest") {
-                log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
-                        string(" requested to pull files ")).append(prettyListFiles(queryJ)), logFilepath);
-                doPullResponse(sock, directory, queryJ);
-            } else if (type == "pushRequest") {
-                log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
-                        string(" requested to push files ")).append(prettyListFiles(queryJ)), logFilepath);
-                doPushResponse(sock, directory, queryJ);
-            } else if (type == "leave") {
-                log("Client at " + getPeerStringFromSocket(sock) + " cleanly closed connection", logFilepath);
-                closeSocket(sock, client_socket, client_sock_close_index);
-            } else {
-                cout << "Unknown type: " << type << endl;
-                closeSocket(sock, client_socket, client_sock_close_index);
-            }
-        }
+void closeSocket(int sock, int* clientSockets, int clientSocketIndex, ConnectionMap &connections){
+    clientSockets[clientSocketIndex] = 0;
+    closeConnection(sock, connections);
+}
 
-        // Loop
-    } catch (std::exception &e) {
-        log("Client at " + getPeerStringFromSocket(sock) + " unexpectedly closed connection", logFilepath);
-        closeSocket(sock, client_socket, client_sock_close_index);
+/*
+ * Answer with only the files that changed after the client's generation, and the names of those removed. If the
+ * journal can't say, because the server restarted, the client is too far behind or too much changed, the client gets
+ * the first page of the whole listing instead.
+ */
+void doListSinceResponse(SocketWriter &writer, const string &directory, const json &listSinceRequest) {
+    ListingChanges changes;
+    double since = listSinceRequest["generation"].getNumber();
+    bool known = listSinceRequest["version"].getNumber() >= LIST_SINCE_VERSION && since >= 0 &&
+                 listChanges(directory, listSinceRequest["journal"].getString(), static_cast<uint64_t>(since), changes);
+    if (!known) {
+        json listRequest;
+        listRequest["version"] = listSinceRequest["version"].getNumber();
+        listRequest["type"] = JSON("listRequest", true);
+        listRequest["limit"] = static_cast<double>(LIST_PAGE_SIZE);
+        copyRequestId(listSinceRequest, listRequest);
+        doListResponse(writer, directory, listRequest);
         return;
     }
-}
 
-int main(int argc, char **argv) {
-    unsigned int serverPort;
-    string directory = ".";
-    string logFilepath = "serverLog.txt";
+    vector<json> jsonFiles;
+    jsonFiles.reserve(changes.changed.size());
+    for (auto f : changes.changed) {
+        jsonFiles.push_back(f.getAsJSON(false));
+    }
+    json removed;
+    removed.makeArray();
+    for (const auto &filename : changes.removed) {
+        removed.push(JSON(filename, true));
+    }
 
-    // Select() code
-    // ------------------------------------------
-    int opt = true;
-    const int max_clients = 1024;
-    int master_socket;
-    int client_socket[max_clients];
+    json listResponsePacket;
+    listResponsePacket["version"] = LIST_SINCE_VERSION;
+    listResponsePacket["maxVersion"] = LIST_SINCE_VERSION;
+    listResponsePacket["type"] = JSON("listResponse", true);
+    listResponsePacket["response"] = jsonFiles;
+    listResponsePacket["journal"] = listSinceRequest["journal"];
+    listResponsePacket["generation"] = static_cast<double>(changes.generation);
+    listResponsePacket["since"] = since;
+    listResponsePacket["removed"] = std::move(removed);
+    copyRequestId(listSinceRequest, listResponsePacket);
+    if (!sendToSocket(writer, listResponsePacket)) {
+        throw std::runtime_error("Unable to send listResponse");
+    }
+}
 
-    // set of socket descriptors
-    fd_set readfds;
+/*
+ * Handle every message the client has sent so far. Returns false once the connection should be closed.
+ */
+bool handleClient(Connection &connection, const string &directory, const string &logFilepath) {
+    int sock = connection.sock;
+    SocketReader &reader = connection.reader;
+    SocketWriter &writer = connection.writer;
+
+    // A client may have sent more than one message in a single read, so keep going until the buffer has no
+    // complete messages left; the event loop won't wake us up for bytes that we've already received
+    do {
+        try {
+            auto queryJ = receiveMessage(reader);  // throws if an invalid message was received
+            debug("Received: ", queryJ);
+
+            if (verifyJSONPacket(queryJ)) {
+                string type = queryJ["type"].getString();
+
+                if (type == "listRequest") {
+                    log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
+                            string(" requested a list of files")), logFilepath);
+                    doListResponse(writer, directory, queryJ);
+                } else if (type == "listSinceRequest") {
+                    log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
+                            string(" requested the files changed since generation ")).append(
+                            std::to_string(static_cast<uint64_t>(queryJ["generation"].getNumber()))), logFilepath);
+                    doListSinceResponse(writer, directory, queryJ);
+                } else if (type == "pullRequest") {
+                    log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
+                            string(" requested to pull files ")).append(prettyListFiles(queryJ)), logFilepath);
+                    doPullResponse(writer, directory, queryJ);
+                } else if (type == "pushRequest") {
+                    log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
+                            string(" requested to push files ")).append(prettyListFiles(queryJ)), logFilepath);
+                    doPushResponse(reader, writer, directory, queryJ, logFilepath);
+                } else if (type == "manifestRequest") {
+                    log(string("Client at ").append(getPeerStringFromSocket(sock)).append(
+                            string(" requested chunk manifests for ")).append(prettyListFiles(queryJ)), logFilepath);
+                    doManifestResponse(writer, directory, queryJ);
+                } else if (type == "leave") {
+                    log("Client at " + getPeerStringFromSocket(sock) + " cleanly closed connection", logFilepath);
+                    return false;
+                } else {
+                    cout << "Unknown type: " << type << endl;
+                    return false;
+                }
+            }
 
-    for (int i = 0; i < max_clients; i++) {
-        client_socket[i] = 0;
-    }
+            // Loop
+        } catch (std::exception &e) {
+            log("Client at " + getPeerStringFromSocket(sock) + " unexpectedly closed connection", logFilepath);
+            return false;
+        }
+    } while (reader.hasBufferedMessage('\n'));
+    return true;
+}
 
-    if ((master_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("socket failed");
-        exit(EXIT_FAILURE);
+/*
+ * Workers report back to the event loop through this queue, and write a byte to the pipe so that the loop wakes
+ * up to look at it
+ */
+struct Completions {
+    std::mutex mutex;
+    vector<std::pair<int, bool>> finished;  // socket, whether to keep it open
+    int wakePipe[2];
+
+    void add(int sock, bool keepOpen) {
+        {
+            std::lock_guard<std::mutex> guard(this->mutex);
+            this->finished.emplace_back(sock, keepOpen);
+        }
+        char wake = 0;
+        if (write(this->wakePipe[1], &wake, 1) < 0) {
+            perror("Could not wake up the listening thread");
+        }
     }
 
-    // set master socket to accept multiple connections (up to 1024)
-    if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *) &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
+    vector<std::pair<int, bool>> take() {
+        char drain[64];
+        while (read(this->wakePipe[0], drain, sizeof(drain)) == sizeof(drain)) {}
+        std::lock_guard<std::mutex> guard(this->mutex);
+        vector<std::pair<int, bool>> taken;
+        taken.swap(this->finished);
+        return taken;
     }
+};
+
+#ifdef USE_EPOLL
+/*
+ * Send whatever is still queued for the client and read whatever the client has sent, without blocking, handing the
+ * connection to a worker once a whole message has arrived. Sockets are registered edge-triggered, so this has to keep
+ * going until the socket would block or a message is found; otherwise epoll won't report the socket again.
+ */
+void serviceConnection(int sock, ConnectionMap &connections, ThreadPool &pool, Completions &completions,
+                       unsigned int numThreads, const string &directory, const string &logFilepath) {
+    Connection *connection = connections.at(sock).get();
+    while (true) {
+        // Earlier responses have to be mostly out before the next request is read, so a client that doesn't read its
+        // responses can't make the server queue more and more of them
+        if (connection->writer.pending() > 0) {
+            SocketWriter::FlushStatus status = connection->writer.flush();
+            if (status == SocketWriter::WouldBlock && connection->writer.buffered() > PIPELINE_QUEUE_LIMIT) {
+                return;
+            }
+            if (status == SocketWriter::Failed) {
+                log("Client at " + getPeerStringFromSocket(sock) + " unexpectedly closed connection", logFilepath);
+                closeConnection(sock, connections);
+                return;
+            }
+        }
 
-    InputParser input(argc, argv);
-    if (input.findCmdHelp()) {
-        printHelp(argv);
-    }
-    if (input.cmdOptionExists("-p")) {
-        serverPort = htons(static_cast<uint16_t>((unsigned int) stoul(input.getCmdOption("-p"))));
-    } else {
-        printHelp(argv);
-    }
-    if (input.cmdOptionExists("-d")) {
-        string newDirectory = input.getCmdOption("-d");
+        switch (connection->reader.receiveAvailable('\n')) {
+            case SocketReader::WouldBlock:
+                return;
+            case SocketReader::Closed:
+                log("Client at " + getPeerStringFromSocket(sock) + " unexpectedly closed connection", logFilepath);
+                closeConnection(sock, connections);
+                return;
+            case SocketReader::MessageReady:
+                if (numThreads == 0) {
+                    if (!handleClient(*connection, directory, logFilepath)) {
+                        closeConnection(sock, connections);
+                        return;
+                    }
+                    continue;
+                }
 
-        if (!isDirectory(newDirectory)) {
-            cout << "Could not access provided directory: "
-                 << newDirectory << ", are you sure that's a directory?" << endl;
-            exit(1);
+                connection->busy = true;
+                pool.submit([connection, &directory, &logFilepath, &completions] {
+                    completions.add(connection->sock, handleClient(*connection, directory, logFilepath));
+                });
+                return;
         }
+    }
+}
 
-        directory = newDirectory;
+void runEpollLoop(int masterSocket, ThreadPool &pool, Completions &completions, unsigned int numThreads,
+                  const string &directory, const string &logFilepath) {
+    // State for each connected client, keyed by socket descriptor
+    ConnectionMap connections;
+
+    int epollFd = epoll_create1(0);
+    if (epollFd < 0) {
+        perror("epoll_create1() failed");
+        exit(1);
     }
 
-    if (directory.back() != '/' && directory.back() != '\\') {
-        directory = directory + '/';
+    // The listening socket and the worker wakeup pipe are level-triggered, since they are always drained completely
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = masterSocket;
+    setNonBlocking(masterSocket);
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, masterSocket, &event) < 0) {
+        perror("epoll_ctl() failed");
+        exit(1);
+    }
+    event.data.fd = completions.wakePipe[0];
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, completions.wakePipe[0], &event) < 0) {
+        perror("epoll_ctl() failed");
+        exit(1);
     }
 
-    // Create structs to save the server and client addresses
-    struct sockaddr_in serverAddress; /* Local address */
+    const int maxEvents = 64;
+    struct epoll_event events[maxEvents];
 
-    /* Construct local address structure */
-    memset(&serverAddress, 0, sizeof(serverAddress)); /* Zero out structure */
-    serverAddress.sin_family = AF_INET; /* Internet address family */
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    serverAddress.sin_port = serverPort; /* Local port */
+    // Constantly listen for clients
+    while (true) {
+        int ready = epoll_wait(epollFd, events, maxEvents, -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait() error");
+            }
+            continue;
+        }
 
-    /* Bind to the local address */
-    if (bind(master_socket, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0) {
-        perror("bind() failed");
-        exit(1);
+        for (int e = 0; e < ready; e++) {
+            int fd = events[e].data.fd;
+
+            // Take back connections that the workers are done with
+            if (fd == completions.wakePipe[0]) {
+                for (auto finished : completions.take()) {
+                    if (!finished.second) {
+                        closeConnection(finished.first, connections);
+                        continue;
+                    }
+                    // Anything that arrived while the worker had the connection didn't produce an event we acted on,
+                    // so look at the socket now
+                    connections.at(finished.first)->busy = false;
+                    serviceConnection(finished.first, connections, pool, completions, numThreads, directory,
+                                      logFilepath);
+                }
+            }
+                // Handle incoming connections on master socket
+            else if (fd == masterSocket) {
+                while (true) {
+                    int newSocket = accept(masterSocket, nullptr, nullptr);
+                    if (newSocket < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                            perror("accept");
+                        }
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                            continue;
+                        }
+                        break;
+                    }
+
+                    // inform user of socket number - used in send and receive commands
+                    stringstream msgStream;
+                    msgStream << "New connection request from client at " << getPeerStringFromSocket(newSocket);
+                    log(msgStream.str(), logFilepath);
+
+                    struct epoll_event clientEvent;
+                    memset(&clientEvent, 0, sizeof(clientEvent));
+                    clientEvent.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    clientEvent.data.fd = newSocket;
+                    if (!setNonBlocking(newSocket) || epoll_ctl(epollFd, EPOLL_CTL_ADD, newSocket, &clientEvent) < 0) {
+                        perror("  Connection request denied");
+                        close(newSocket);
+                        continue;
+                    }
+                    connections[newSocket] = std::unique_ptr<Connection>(new Connection(newSocket));
+                    stringstream s;
+                    s << "  Connection request granted; adding to list of sockets as " << newSocket;
+                    log(s.str(), logFilepath);
+                }
+            }
+                // Handle IO operations on socket with incoming message
+            else {
+                auto found = connections.find(fd);
+                // A worker has this connection, and will hand it back through the completions queue
+                if (found == connections.end() || found->second->busy) {
+                    continue;
+                }
+                serviceConnection(fd, connections, pool, completions, numThreads, directory, logFilepath);
+            }
+        }
     }
+}
+#else
+void runSelectLoop(int master_socket, ThreadPool &pool, Completions &completions, unsigned int numThreads,
+                   const string &directory, const string &logFilepath) {
+    const int max_clients = 1024;
+    int client_socket[max_clients];
+    // State for each connected client, keyed by socket descriptor
+    ConnectionMap connections;
 
-    /* Mark the socket so it will listen for incoming connections */
-    if (listen(master_socket, max_clients) < 0) {
-        perror("listen() failed");
-        exit(1);
+    // set of socket descriptors
+    fd_set readfds;
+
+    for (int i = 0; i < max_clients; i++) {
+        client_socket[i] = 0;
     }
 
-    int addrlen = sizeof(serverAddress);
+    struct sockaddr_in clientAddress;
+    int addrlen = sizeof(clientAddress);
 
     // Constantly listen for clients
     while (true) {
         // clear the socket set
         FD_ZERO(&readfds);
 
-        // add master socket to set
+        // add master socket and the worker wakeup pipe to set
         FD_SET(master_socket, &readfds);
-        int max_sd = master_socket;
+        FD_SET(completions.wakePipe[0], &readfds);
+        int max_sd = std::max(master_socket, completions.wakePipe[0]);
 
         // add child sockets to set
         for (int i = 0; i < max_clients; i++) {
             // socket descriptor
             int sd = client_socket[i];
-            // if the socket descriptor is valid, add it to the read list of sockets
-            if (sd > 0){
+            // if the socket descriptor is valid and no worker has it, add it to the read list of sockets
+            if (sd > 0 && !connections.at(sd)->busy){
                 FD_SET(sd, &readfds);
             }
 
@@ -243,10 +756,26 @@ int main(int argc, char **argv) {
             printf("select() error");
         }
 
+        // Take back connections that the workers are done with
+        if (FD_ISSET(completions.wakePipe[0], &readfds)) {
+            for (auto finished : completions.take()) {
+                for (int i = 0; i < max_clients; i++) {
+                    if (client_socket[i] == finished.first) {
+                        if (finished.second) {
+                            connections.at(finished.first)->busy = false;
+                        } else {
+                            closeSocket(finished.first, client_socket, i, connections);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+
         // Handle incoming connection on master socket
         if (FD_ISSET(master_socket, &readfds)) {
             int new_socket;
-            if ((new_socket = accept(master_socket, (struct sockaddr *) &serverAddress, (socklen_t *) &addrlen)) < 0) {
+            if ((new_socket = accept(master_socket, (struct sockaddr *) &clientAddress, (socklen_t *) &addrlen)) < 0) {
                 perror("accept");
                 exit(EXIT_FAILURE);
             }
@@ -261,6 +790,7 @@ int main(int argc, char **argv) {
                 // if position is empty
                 if (client_socket[i] == 0) {
                     client_socket[i] = new_socket;
+                    connections[new_socket] = std::unique_ptr<Connection>(new Connection(new_socket));
                     stringstream s;
                     s << "  Connection request granted; adding to list of sockets as " << i;
                     log(s.str(), logFilepath);
@@ -275,11 +805,158 @@ int main(int argc, char **argv) {
         for (int i = 0; i < max_clients; i++) {
             int sd = client_socket[i];
 
-            if (FD_ISSET(sd, &readfds)) {
-                handleClient(sd, directory, client_socket, i, logFilepath);
+            if (sd > 0 && FD_ISSET(sd, &readfds)) {
+                Connection *connection = connections.at(sd).get();
+                // The select() loop doesn't watch for writability, so responses are sent in full before moving on
+                if (numThreads == 0) {
+                    if (!handleClient(*connection, directory, logFilepath) || !connection->writer.flushBelow(0)) {
+                        closeSocket(sd, client_socket, i, connections);
+                    }
+                    continue;
+                }
+
+                connection->busy = true;
+                pool.submit([connection, &directory, &logFilepath, &completions] {
+                    completions.add(connection->sock, handleClient(*connection, directory, logFilepath) &&
+                                                      connection->writer.flushBelow(0));
+                });
             }
         }
     }
+}
+#endif
+
+int main(int argc, char **argv) {
+    unsigned int serverPort;
+    string directory = ".";
+    string logFilepath = "serverLog.txt";
+    unsigned int numThreads = ThreadPool::defaultSize();
+
+    int opt = true;
+    int master_socket;
+
+    if ((master_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // set master socket to accept multiple connections (up to 1024)
+    if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *) &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    // A client that disconnects mid-response should fail that send, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    InputParser input(argc, argv);
+    if (input.findCmdHelp()) {
+        printHelp(argv);
+    }
+    if (input.cmdOptionExists("-p")) {
+        serverPort = htons(static_cast<uint16_t>((unsigned int) stoul(input.getCmdOption("-p"))));
+    } else {
+        printHelp(argv);
+    }
+    if (input.cmdOptionExists("-d")) {
+        string newDirectory = input.getCmdOption("-d");
+
+        if (!isDirectory(newDirectory)) {
+            cout << "Could not access provided directory: "
+                 << newDirectory << ", are you sure that's a directory?" << endl;
+            exit(1);
+        }
+
+        directory = newDirectory;
+    }
+    if (input.cmdOptionExists("-t")) {
+        numThreads = static_cast<unsigned int>(stoul(input.getCmdOption("-t")));
+    }
+
+    if (directory.back() != '/' && directory.back() != '\\') {
+        directory = directory + '/';
+    }
+
+    if (input.cmdOptionExists("-c") && input.cmdOptionExists("-e")) {
+        printHelp(argv);
+    }
+    string storeFiles = directory + CHUNK_STORE_DIRNAME + "/files";
+    if (input.cmdOptionExists("-e") && isDirectory(storeFiles)) {
+        ChunkStore store(directory);
+        set<string> taken;
+        for (const auto &path : directoryFileListing(directory)) {
+            taken.insert(getFilename(path));
+        }
+        for (const auto &stored : store.filenames()) {
+            string filename = filenameIncrement(stored, taken);
+            if (store.exportFile(stored, directory + filename)) {
+                taken.insert(filename);
+            }
+        }
+    }
+
+    if (input.cmdOptionExists("-c")) {
+        vector<string> plainFiles = directoryFileListing(directory);
+        // Moving files into the store deletes them from the directory, so it's only done when asked for
+        if (!plainFiles.empty() && !input.cmdOptionExists("-i")) {
+            std::cerr << directory << " has files outside the chunk store, which won't be served with -c. Add -i to "
+                      << "move them into the store." << endl;
+            exit(1);
+        }
+        chunkStore = new ChunkStore(directory);
+        for (const auto &path : plainFiles) {
+            string filename = filenameIncrement(getFilename(path), chunkStore->filenames());
+            if (!chunkStore->importFile(path, filename)) {
+                std::cerr << "Could not move " << path << " into the chunk store" << endl;
+            }
+        }
+    } else {
+        if (isDirectory(storeFiles) && !directoryFileListing(storeFiles).empty()) {
+            std::cerr << "Files in " << directory << "'s chunk store won't be served without -c. Start with -e to "
+                      << "move them back into the directory." << endl;
+        }
+        watcher = new DirectoryWatcher(directory);
+        if (!watcher->start()) {
+            delete watcher;
+            watcher = nullptr;
+        }
+    }
+
+    // Create structs to save the server and client addresses
+    struct sockaddr_in serverAddress; /* Local address */
+
+    /* Construct local address structure */
+    memset(&serverAddress, 0, sizeof(serverAddress)); /* Zero out structure */
+    serverAddress.sin_family = AF_INET; /* Internet address family */
+    serverAddress.sin_addr.s_addr = INADDR_ANY;
+    serverAddress.sin_port = serverPort; /* Local port */
+
+    /* Bind to the local address */
+    if (bind(master_socket, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0) {
+        perror("bind() failed");
+        exit(1);
+    }
+
+    /* Mark the socket so it will listen for incoming connections */
+    if (listen(master_socket, SOMAXCONN) < 0) {
+        perror("listen() failed");
+        exit(1);
+    }
+
+    // Requests are handled on the worker pool so that one slow client doesn't hold up the others
+    ThreadPool pool(numThreads);
+    Completions completions;
+    if (pipe(completions.wakePipe) < 0) {
+        perror("pipe() failed");
+        exit(1);
+    }
+    fcntl(completions.wakePipe[0], F_SETFL, O_NONBLOCK);
+
+#ifdef USE_EPOLL
+    runEpollLoop(master_socket, pool, completions, numThreads, directory, logFilepath);
+#else
+    runSelectLoop(master_socket, pool, completions, numThreads, directory, logFilepath);
+#endif
 
     return 0;
 }
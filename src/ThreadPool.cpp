@@ -0,0 +1,53 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned int numThreads) {
+    for (unsigned int i = 0; i < numThreads; i++) {
+        this->workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+// Finishes every task that was already submitted before returning
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->available.notify_all();
+    for (auto &worker : this->workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(const std::function<void()> &task) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->tasks.push_back(task);
+    }
+    this->available.notify_one();
+}
+
+unsigned int ThreadPool::size() const {
+    return static_cast<unsigned int>(this->workers.size());
+}
+
+// One thread per core, or a single thread if the core count can't be determined
+unsigned int ThreadPool::defaultSize() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->available.wait(lock, [this] { return this->stopping || !this->tasks.empty(); });
+            if (this->tasks.empty()) {
+                return;
+            }
+            task = std::move(this->tasks.front());
+            this->tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// A fixed set of worker threads that run submitted tasks in the order they were submitted
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned int numThreads);
+
+    ~ThreadPool();
+
+    void submit(const std::function<void()> &task);
+
+    unsigned int size() const;
+
+    static unsigned int defaultSize();
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+};
+
+#endif
@@ -24,9 +24,15 @@ void testFilenameIncrement();
 
 void testBase64Decoding();
 
+void testBase64AllLengths();
+
+void testBase64DecodingInvalidCharacters();
+
 int main() {
      testBase64Encoding();
      testBase64Decoding();
+     testBase64AllLengths();
+     testBase64DecodingInvalidCharacters();
     return 0;
 }
 
@@ -120,3 +126,70 @@ void testBase64Decoding() {
     testBase64DecodingHappyString();
     testBase64DecodingBinaryFile();
 }
+
+// Lengths up to a few hundred bytes go through every combination of vector blocks and scalar leftovers
+void testBase64AllLengths() {
+    cout << "Testing Base64 encoding and decoding of every length from 0 to 511 bytes" << endl;
+    uint32_t seed = 12345;
+    for (size_t length = 0; length < 512; length++) {
+        string input(length, '\0');
+        for (auto &c : input) {
+            seed = seed * 1103515245 + 12345;
+            c = static_cast<char>(seed >> 16);
+        }
+        string target;
+        Base64::Encode(input, &target);
+
+        vector<char> buffer(input.begin(), input.end());
+        string myEncoding = base64Encode(buffer);
+        assert(myEncoding == target);
+        assert(base64Decode(myEncoding) == input);
+
+        // The buffer variants write into preallocated output
+        vector<char> encoded(base64EncodedLength(length));
+        assert(base64Encode(input.data(), length, encoded.data()) == target.size());
+        assert(string(encoded.begin(), encoded.end()) == target);
+        vector<char> decoded(base64DecodedMaxLength(target.size()));
+        assert(base64Decode(target.data(), target.size(), decoded.data()) == length);
+        assert(string(decoded.begin(), decoded.begin() + length) == input);
+    }
+    cout << "    All lengths match" << endl;
+}
+
+/*
+ * Characters outside the alphabet decode as zero bits and '=' drops the bytes it stands for, wherever they appear.
+ * The vector decoders hand any block containing them to the scalar code, so the output must not change.
+ */
+void testBase64DecodingInvalidCharacters() {
+    cout << "Testing Base64 decoding of strings with invalid characters" << endl;
+    string valid;
+    for (size_t i = 0; i < 256; i++) {
+        valid += BASE64_CHARS[(i * 7) % 64];
+    }
+    const char replacements[] = {'=', '\n', ' ', '.', '\x80', '\xff', '\0'};
+
+    for (char replacement : replacements) {
+        for (size_t position = 0; position < valid.size(); position += 5) {
+            string input = valid;
+            input[position] = replacement;
+
+            // Expected output, one group of four characters at a time
+            string target;
+            for (size_t i = 0; i + 3 < input.size(); i += 4) {
+                uint32_t group = 0;
+                for (size_t j = 0; j < 4; j++) {
+                    group = (group << 6) | BASE64_REVERSE_MAP[static_cast<uint8_t>(input[i + j])];
+                }
+                target += static_cast<char>(group >> 16);
+                if (input[i + 2] != BASE64_PAD_CHAR) {
+                    target += static_cast<char>(group >> 8);
+                }
+                if (input[i + 3] != BASE64_PAD_CHAR) {
+                    target += static_cast<char>(group);
+                }
+            }
+            assert(base64Decode(input) == target);
+        }
+    }
+    cout << "    All decodings match" << endl;
+}
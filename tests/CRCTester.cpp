@@ -49,10 +49,30 @@ void testFileBinary() {
     assert(target == actual);
 }
 
+// Large enough, and an odd enough length, to go through every CRC kernel and the leftover bytes after them
+void testFileLarge() {
+    string filepath = "testClientDir/large.binary";
+    cout << "Testing checksum for large generated file: " << filepath << endl;
+    std::ofstream output(filepath, ios::binary | ios::trunc);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < 1024 * 1024 + 13; i++) {
+        state = state * 1103515245 + 12345;
+        output.put(static_cast<char>(state >> 16));
+    }
+    output.close();
+
+    string target = libBasedChecksum(filepath);
+    string actual = computeCRC(filepath);
+    cout << "Target: " << target << endl;
+    cout << "Actual: " << actual << endl;
+    assert(target == actual);
+}
+
 int main() {
   testFileD();
   testFileEmpty();
   testFileBinary();
+  testFileLarge();
 }
 
 
@@ -1,5 +1,7 @@
 #include "../src/Project4Common.h"
 #include "../src/HappyPathJSON.h"
+#include "../src/ChunkStore.h"
+#include "../src/DirectoryWatcher.h"
 #include <assert.h>
 
 using std::string;
@@ -65,11 +67,617 @@ void testFilenameIncrement() {
     cout << "    Target output: " << "file2 (3).ext" << endl;
     cout << "    Actual output: " << obsvFname << endl;
     assert(obsvFname == "file2 (3).ext");
+
+    cout << "  Check if a filename present with more than 9 increments gets a two digit increment" << endl;
+    for (int i = 3; i <= 9; i++) {
+        existingFilenames.insert("file2 (" + std::to_string(i) + ").ext");
+    }
+    obsvFname = filenameIncrement("file2.ext", existingFilenames);
+    cout << "    Target output: " << "file2 (10).ext" << endl;
+    cout << "    Actual output: " << obsvFname << endl;
+    assert(obsvFname == "file2 (10).ext");
+}
+
+void testJSONCopies() {
+    cout << "Testing JSON copies" << endl;
+    json original = json("{\"request\":[{\"filename\":\"foo\",\"checksum\":\"bar\"}]}");
+
+    cout << "  Check that changing a copy leaves the original alone" << endl;
+    json copy = original;
+    copy["request"].push(json("{\"filename\":\"foo2\",\"checksum\":\"bar2\"}"));
+    assert(original["request"].size() == 1);
+    assert(copy["request"].size() == 2);
+
+    cout << "  Check that a copy taken while a reference is held doesn't change through that reference" << endl;
+    json &filename = original["request"][0]["filename"];
+    json snapshot = original;
+    filename = JSON("changed", true);
+    assert(snapshot["request"][0]["filename"].getString() == "foo");
+    assert(original["request"][0]["filename"].getString() == "changed");
+
+    cout << "  Check that a moved from value is left blank" << endl;
+    json moved = std::move(snapshot);
+    assert(snapshot.isBlank());
+    assert(prettyListFiles(moved) == "(foo)");
+}
+
+void testJSONArena() {
+    cout << "Testing JSON parsed into an arena" << endl;
+    string message = "{\"request\":[{\"filename\":\"foo\",\"checksum\":\"bar\"}]}";
+    json file;
+    {
+        auto arena = std::make_shared<JSONArena>();
+        json parsed = json(message, arena);
+        cout << "  Check that it matches the same message parsed without one" << endl;
+        assert(parsed == json(message));
+        assert(arena->bytesAllocated() > 0);
+        file = parsed["request"][0];
+    }
+
+    cout << "  Check that a view reads the same as a parsed message, escapes and all" << endl;
+    string escaped = "{\"type\":\"push\\nRequest\",\"request\":[{\"filename\":\"f\\\"oo\",\"checksum\":\"bar\"}]}";
+    json view = json::view(escaped, std::make_shared<JSONArena>());
+    assert(view == json(escaped));
+    assert(view.stringify() == json(escaped).stringify());
+    assert(view["type"].getString() == "push\nRequest");
+
+    cout << "  Check that part of the document is still usable after the rest is gone" << endl;
+    assert(file["filename"].getString() == "foo");
+}
+
+void testBinaryMessages() {
+    cout << "Testing binary messages" << endl;
+    json pullRequest = json("{\"version\":3,\"type\":\"pullRequest\",\"request\":["
+                            "{\"filename\":\"foo.mp3\",\"checksum\":\"3d27d573\"},"
+                            "{\"filename\":\"b\u00e4r\",\"checksum\":\"0\"}]}");
+    string encoded = encodeBinaryMessage(pullRequest);
+
+    cout << "  Check that a message decodes to what was encoded" << endl;
+    FrameHeader header;
+    assert(decodeFrameHeader(encoded.data(), header));
+    assert(header.length == encoded.size() - FRAME_HEADER_LENGTH);
+    json decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == pullRequest);
+    assert(verifyJSONPacket(decoded, "pullRequest"));
+
+    cout << "  Check that a listResponse keeps its maxVersion" << endl;
+    json listResponse = json("{\"version\":3,\"maxVersion\":3,\"type\":\"listResponse\",\"response\":[]}");
+    encoded = encodeBinaryMessage(listResponse);
+    decodeFrameHeader(encoded.data(), header);
+    decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == listResponse);
+    assert(negotiateVersion(decoded) == BINARY_VERSION);
+
+    cout << "  Check that a version 5 message keeps its request ID" << endl;
+    json pushResponse = json("{\"version\":5,\"type\":\"pushResponse\",\"id\":4000000000,\"response\":["
+                             "{\"filename\":\"foo.mp3\",\"checksum\":\"3d27d573\"}]}");
+    encoded = encodeBinaryMessage(pushResponse);
+    decodeFrameHeader(encoded.data(), header);
+    decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == pushResponse);
+    assert(verifyJSONPacket(decoded, "pushResponse"));
+
+    cout << "  Check that a version 7 listing keeps its page limit and cursors" << endl;
+    json listRequest = json("{\"version\":7,\"type\":\"listRequest\",\"limit\":5000,\"after\":\"foo.mp3\"}");
+    encoded = encodeBinaryMessage(listRequest);
+    decodeFrameHeader(encoded.data(), header);
+    decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == listRequest);
+    assert(verifyJSONPacket(decoded, "listRequest"));
+    listResponse = json("{\"version\":7,\"maxVersion\":7,\"type\":\"listResponse\",\"response\":["
+                        "{\"filename\":\"foo.mp3\",\"checksum\":\"3d27d573\"}],\"next\":\"foo.mp3\"}");
+    encoded = encodeBinaryMessage(listResponse);
+    decodeFrameHeader(encoded.data(), header);
+    decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == listResponse);
+    assert(negotiateVersion(decoded) == PAGED_LIST_VERSION);
+
+    cout << "  Check that a version 8 listing keeps its journal generation and removed files" << endl;
+    json listSinceRequest = json("{\"version\":8,\"type\":\"listSinceRequest\",\"journal\":\"9f3ac0de12345678\","
+                                 "\"generation\":4294967301}");
+    encoded = encodeBinaryMessage(listSinceRequest);
+    decodeFrameHeader(encoded.data(), header);
+    decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == listSinceRequest);
+    assert(verifyJSONPacket(decoded, "listSinceRequest"));
+    listResponse = json("{\"version\":8,\"maxVersion\":8,\"type\":\"listResponse\",\"response\":["
+                        "{\"filename\":\"foo.mp3\",\"checksum\":\"3d27d573\"}],\"journal\":\"9f3ac0de12345678\","
+                        "\"generation\":4294967309,\"since\":4294967301,\"removed\":[\"b\u00e4r\"]}");
+    encoded = encodeBinaryMessage(listResponse);
+    decodeFrameHeader(encoded.data(), header);
+    decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == listResponse);
+    assert(verifyJSONPacket(decoded, "listResponse"));
+    assert(negotiateVersion(decoded) == LIST_SINCE_VERSION);
+
+    cout << "  Check that a truncated message is rejected" << endl;
+    bool threw = false;
+    try {
+        header.length--;
+        decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    } catch (std::invalid_argument &e) {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void testChunking() {
+    cout << "Testing content-defined chunking" << endl;
+    string data(2000000, '\0');
+    unsigned int seed = 1;
+    for (auto &c : data) {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<char>(seed >> 16);
+    }
+    vector<Chunk> chunks = chunkData(data.data(), data.size());
+
+    cout << "  Check that chunks cover the data and stay within the size limits" << endl;
+    size_t total = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        assert(chunks[i].length <= MAX_CHUNK_SIZE);
+        assert(chunks[i].length >= MIN_CHUNK_SIZE || i == chunks.size() - 1);
+        total += chunks[i].length;
+    }
+    assert(total == data.size());
+
+    cout << "  Check that an insertion at the start only changes the chunks around it" << endl;
+    string edited = "ID3" + string(1000, 'x') + data;
+    vector<Chunk> editedChunks = chunkData(edited.data(), edited.size());
+    size_t shared = 0;
+    for (const auto &chunk : editedChunks) {
+        for (const auto &original : chunks) {
+            if (chunk.hash == original.hash && chunk.length == original.length) {
+                shared++;
+                break;
+            }
+        }
+    }
+    assert(shared + 2 >= editedChunks.size());
+
+    cout << "  Check that manifests survive a version 4 binary message" << endl;
+    json pushRequest = json("{\"version\":4,\"type\":\"pushRequest\",\"request\":["
+                            "{\"filename\":\"a.mp3\",\"checksum\":\"1\",\"base\":\"a.mp3\"},"
+                            "{\"filename\":\"b.mp3\",\"checksum\":\"2\"}]}");
+    pushRequest["request"][1]["chunks"] = chunksToJSON(chunks);
+    string encoded = encodeBinaryMessage(pushRequest);
+    FrameHeader header;
+    decodeFrameHeader(encoded.data(), header);
+    json decoded = decodeBinaryMessage(header, encoded.data() + FRAME_HEADER_LENGTH);
+    assert(decoded == pushRequest);
+    vector<Chunk> decodedChunks = chunksFromJSON(decoded["request"][1]["chunks"]);
+    assert(decodedChunks.size() == chunks.size());
+    assert(decodedChunks.back().hash == chunks.back().hash);
+}
+
+void testFileDelta() {
+    cout << "Testing file deltas" << endl;
+    string basePath = "testClientDir/.deltaBase";
+    string targetPath = "testClientDir/.deltaTarget";
+    string receivedPath = "testClientDir/.deltaReceived";
+    string data(500000, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>((i * 2654435761u) >> 13);
+    }
+    std::ofstream(basePath, std::ios::binary) << data;
+    std::ofstream(targetPath, std::ios::binary) << "ID3 new tag" << data.substr(100);
+
+    DeltaBase base;
+    base.path = basePath;
+    assert(chunkFile(basePath, base.chunks));
+
+    int socks[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+    SocketReader reader(socks[1]);
+
+    cout << "  Check that a delta rebuilds the file and is smaller than it" << endl;
+    SocketWriter writer(socks[0]);
+    assert(sendFileDelta(writer, targetPath, base.chunks, false));
+    size_t sent = writer.pending();
+    assert(sent < data.size() / 4);
+    assert(writer.flushBelow(0));
+    string checksum;
+    assert(receiveFileChunks(reader, receivedPath, checksum, &base));
+    assert(checksum == computeCRC(targetPath));
+
+    cout << "  Check that a delta without its base is read but doesn't match" << endl;
+    assert(sendFileDelta(writer, targetPath, base.chunks, false));
+    assert(writer.flushBelow(0));
+    assert(receiveFileChunks(reader, "", checksum));
+    assert(checksum.empty());
+
+    close(socks[0]);
+    close(socks[1]);
+    remove(basePath.c_str());
+    remove(targetPath.c_str());
+    remove(receivedPath.c_str());
+}
+
+void testCompression() {
+    cout << "Testing compression" << endl;
+    string text;
+    for (int i = 0; text.size() < 300000; i++) {
+        text += "[" + std::to_string(i / 10) + ":00.00] Another line of lyrics, much like the one before it\n";
+    }
+    string noise(100000, '\0');
+    uint32_t state = 2463534242u;
+    for (auto &byte : noise) {
+        // xorshift32, which doesn't repeat within anything like this length
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        byte = static_cast<char>(state >> 24);
+    }
+
+    cout << "  Check that blocks decompress to what was compressed" << endl;
+    for (const string &data : {string(), string("abc"), string(1000, 'x'), text.substr(0, FILE_CHUNK_SIZE),
+                               noise.substr(0, FILE_CHUNK_SIZE)}) {
+        string compressed;
+        compressBlock(data.data(), data.size(), compressed);
+        assert(compressed.size() <= compressBound(data.size()));
+        vector<char> decompressed(data.size() + 1);
+        assert(decompressBlock(compressed.data(), compressed.size(), decompressed.data(), data.size()));
+        assert(string(decompressed.data(), data.size()) == data);
+    }
+
+    cout << "  Check that a truncated block is rejected" << endl;
+    string compressed;
+    compressBlock(text.data(), FILE_CHUNK_SIZE, compressed);
+    assert(compressed.size() < FILE_CHUNK_SIZE / 4);
+    vector<char> decompressed(FILE_CHUNK_SIZE);
+    assert(!decompressBlock(compressed.data(), compressed.size() / 2, decompressed.data(), FILE_CHUNK_SIZE));
+    assert(!decompressBlock(compressed.data(), compressed.size(), decompressed.data(), FILE_CHUNK_SIZE - 1));
+
+    string textPath = "testClientDir/.compressText.lrc";
+    string noisePath = "testClientDir/.compressNoise.wav";
+    string receivedPath = "testClientDir/.compressReceived";
+    std::ofstream(textPath, std::ios::binary) << text;
+    std::ofstream(noisePath, std::ios::binary) << noise;
+
+    cout << "  Check that only files that will shrink are compressed" << endl;
+    assert(isWorthCompressing(getFilename(textPath), textPath));
+    assert(!isWorthCompressing(getFilename(noisePath), noisePath));
+    assert(!isWorthCompressing("lyrics.mp3", textPath));
+
+    int socks[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == 0);
+    SocketReader reader(socks[1]);
+    SocketWriter writer(socks[0]);
+
+    cout << "  Check that a compressed file arrives intact and smaller" << endl;
+    assert(sendFileChunks(writer, textPath, true));
+    assert(writer.flushBelow(0));
+    string checksum;
+    TransferStats stats{0, 0, false};
+    assert(receiveFileChunks(reader, receivedPath, checksum, nullptr, &stats));
+    assert(checksum == computeCRC(textPath));
+    assert(stats.compressed && stats.fileBytes == text.size() && stats.wireBytes < text.size() / 4);
+
+    cout << "  Check that a file that won't shrink is sent as it is" << endl;
+    assert(sendFileChunks(writer, noisePath, true));
+    assert(writer.flushBelow(0));
+    assert(receiveFileChunks(reader, receivedPath, checksum, nullptr, &stats));
+    assert(checksum == computeCRC(noisePath));
+    assert(!stats.compressed && stats.fileBytes == noise.size());
+
+    close(socks[0]);
+    close(socks[1]);
+    remove(textPath.c_str());
+    remove(noisePath.c_str());
+    remove(receivedPath.c_str());
+}
+
+void testListing() {
+    cout << "Testing directory listings" << endl;
+    char directoryTemplate[] = "testClientDir/.gmmListTest.XXXXXX";
+    string directory = string(mkdtemp(directoryTemplate)) + "/";
+    for (int i = 0; i < 40; i++) {
+        string path = directory + "track" + std::to_string(i) + ".mp3";
+        std::ofstream(path, std::ios::binary) << string(i * 5000, static_cast<char>('a' + i % 26));
+    }
+    vector<string> paths = directoryFileListing(directory);
+
+    cout << "  Check that files checksummed in parallel keep the listing's order" << endl;
+    vector<MusicData> listing = list(directory);
+    assert(listing.size() == paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        assert(listing[i].getPath() == paths[i]);
+        assert(listing[i].getChecksum() == computeCRC(paths[i]));
+    }
+
+    cout << "  Check that paging through the listing gives each file once, in order" << endl;
+    vector<string> paged;
+    string after;
+    for (;;) {
+        vector<MusicData> page = list(directory, after, 7);
+        assert(page.size() <= 7);
+        if (page.empty()) {
+            break;
+        }
+        for (auto &file : page) {
+            assert(file.getFilename() > after);
+            after = file.getFilename();
+            paged.push_back(after);
+        }
+    }
+    assert(paged.size() == paths.size());
+    assert(std::is_sorted(paged.begin(), paged.end()));
+
+    cout << "  Check that looking one file up agrees with the listing" << endl;
+    string checksum;
+    assert(findFile(directory, listing[3].getFilename(), checksum) && checksum == listing[3].getChecksum());
+    assert(!findFile(directory, "missing.mp3", checksum));
+    assert(!findFile(directory, CHECKSUM_INDEX_FILENAME, checksum));
+
+    cout << "  Check that a second listing agrees with the first" << endl;
+    vector<MusicData> again = list(directory);
+    assert(again.size() == listing.size());
+    for (size_t i = 0; i < again.size(); i++) {
+        assert(again[i].getChecksum() == listing[i].getChecksum());
+    }
+
+    assert(system(("rm -rf " + directory).c_str()) == 0);
+}
+
+void testChangeJournal() {
+    cout << "Testing the change journal" << endl;
+    ChangeJournal journal;
+    assert(journal.generation() == 0);
+    journal.record("a.mp3");
+    journal.record("b.mp3");
+    journal.record("a.mp3");
+
+    cout << "  Check that each file changed since a generation is given once" << endl;
+    set<string> filenames;
+    assert(journal.changedSince(0, 10, filenames));
+    assert(filenames == (set<string>{"a.mp3", "b.mp3"}));
+    filenames.clear();
+    assert(journal.changedSince(2, 10, filenames));
+    assert(filenames == (set<string>{"a.mp3"}));
+    filenames.clear();
+    assert(journal.changedSince(3, 10, filenames));
+    assert(filenames.empty());
+
+    cout << "  Check that generations it can't answer for are refused" << endl;
+    assert(!journal.changedSince(4, 10, filenames));
+    assert(!journal.changedSince(0, 1, filenames));
+    assert(ChangeJournal().id() != journal.id());
+    for (size_t i = 0; i < JOURNAL_LENGTH; i++) {
+        journal.record("c.mp3");
+    }
+    filenames.clear();
+    assert(!journal.changedSince(2, 10, filenames));
+    assert(journal.changedSince(3, 10, filenames));
+    assert(filenames == (set<string>{"c.mp3"}));
+}
+
+// Poll a watcher's listing until it has the given file with the given checksum, or doesn't have it if that's empty
+bool waitForListing(DirectoryWatcher &watcher, const string &path, const string &checksum) {
+    for (int attempt = 0; attempt < 200; attempt++) {
+        string listed;
+        for (auto file : watcher.list()) {
+            if (file.getPath() == path) {
+                listed = file.getChecksum();
+            }
+        }
+        if (listed == checksum) {
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+void testDirectoryWatcher() {
+    cout << "Testing the directory watcher" << endl;
+    char directoryTemplate[] = "testServerDir/.gmmWatchTest.XXXXXX";
+    string directory = string(mkdtemp(directoryTemplate)) + "/";
+    std::ofstream(directory + "before.mp3") << "already here";
+    DirectoryWatcher watcher(directory);
+    if (!watcher.start()) {
+        cout << "  inotify isn't available here; skipping" << endl;
+        assert(system(("rm -rf " + directory).c_str()) == 0);
+        return;
+    }
+
+    cout << "  Check that files already in the directory are listed" << endl;
+    assert(waitForListing(watcher, directory + "before.mp3", computeCRC(directory + "before.mp3")));
+
+    cout << "  Check that files written, renamed in and deleted by others are noticed" << endl;
+    uint64_t generation = watcher.generation();
+    std::ofstream(directory + "before.mp3") << "retagged";
+    assert(waitForListing(watcher, directory + "before.mp3", computeCRC(directory + "before.mp3")));
+    std::ofstream(directory + "download.part") << "downloaded";
+    assert(rename((directory + "download.part").c_str(), (directory + "after.mp3").c_str()) == 0);
+    assert(waitForListing(watcher, directory + "after.mp3", computeCRC(directory + "after.mp3")));
+    assert(waitForListing(watcher, directory + "download.part", ""));
+    remove((directory + "before.mp3").c_str());
+    assert(waitForListing(watcher, directory + "before.mp3", ""));
+
+    cout << "  Check that the journal has what changed since an earlier listing" << endl;
+    ListingChanges changes;
+    assert(watcher.changedSince(generation, LIST_PAGE_SIZE, changes));
+    assert(changes.generation > generation);
+    assert(changes.changed.size() == 1 && changes.changed[0].getFilename() == "after.mp3");
+    // download.part is only there if the watcher happened to see it before it was renamed
+    assert(std::count(changes.removed.begin(), changes.removed.end(), "before.mp3") == 1);
+    changes = ListingChanges();
+    assert(watcher.changedSince(watcher.generation(), LIST_PAGE_SIZE, changes));
+    assert(changes.changed.empty() && changes.removed.empty());
+
+    assert(system(("rm -rf " + directory).c_str()) == 0);
+}
+
+// Count the chunks stored under a chunk store's directory
+size_t countStoredChunks(const string &directory) {
+    size_t count = 0;
+    for (const auto &subdirectory : directoryFileListing(directory + CHUNK_STORE_DIRNAME + "/chunks")) {
+        count += directoryFileListing(subdirectory).size();
+    }
+    return count;
+}
+
+void testChunkStore() {
+    cout << "Testing the chunk store" << endl;
+    char directoryTemplate[] = "testServerDir/.gmmStoreTest.XXXXXX";
+    string directory = string(mkdtemp(directoryTemplate)) + "/";
+    string data(300000, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>((i * 2654435761u) >> 11);
+    }
+    string retagged = "ID3 new tag" + data.substr(100);
+
+    cout << "  Check that a near-duplicate only adds the chunks that differ" << endl;
+    {
+        ChunkStore store(directory);
+        ChunkStore::FileWriter original(store);
+        assert(original.write(data.data(), data.size()) && original.finish());
+        assert(original.commit("original.mp3", "1"));
+        size_t chunksBefore = countStoredChunks(directory);
+
+        ChunkStore::FileWriter copy(store);
+        for (size_t offset = 0; offset < retagged.size(); offset += 1000) {
+            copy.write(retagged.data() + offset, std::min(static_cast<size_t>(1000), retagged.size() - offset));
+        }
+        assert(copy.finish() && copy.commit("retagged.mp3", "2"));
+        assert(countStoredChunks(directory) <= chunksBefore + 2);
+        assert(!ChunkStore::FileWriter(store).commit("retagged.mp3", "3"));
+
+        cout << "  Check that the journal has the files committed since a generation" << endl;
+        ListingChanges changes;
+        assert(store.changedSince(1, LIST_PAGE_SIZE, changes));
+        assert(changes.generation == store.generation());
+        assert(changes.changed.size() == 1 && changes.changed[0].getFilename() == "retagged.mp3");
+        assert(changes.changed[0].getChecksum() == "2" && changes.removed.empty());
+
+        cout << "  Check that an uncommitted file releases the chunks it added" << endl;
+        size_t chunksCommitted = countStoredChunks(directory);
+        {
+            ChunkStore::FileWriter abandoned(store);
+            string unrelated(100000, 'z');
+            assert(abandoned.write(unrelated.data(), unrelated.size()) && abandoned.finish());
+        }
+        assert(countStoredChunks(directory) == chunksCommitted);
+    }
+
+    cout << "  Check that files survive reopening the store and read back intact" << endl;
+    ChunkStore store(directory);
+    assert(store.filenames() == (set<string>{"original.mp3", "retagged.mp3"}));
+    vector<Chunk> chunks;
+    vector<string> paths;
+    assert(store.find("retagged.mp3", chunks, paths));
+    string contents;
+    for (const auto &path : paths) {
+        std::ifstream chunkFile(path, std::ios::binary);
+        contents.append(std::istreambuf_iterator<char>(chunkFile), std::istreambuf_iterator<char>());
+    }
+    assert(contents == retagged);
+
+    cout << "  Check that a different chunk with the same hash is stored separately, not shared" << endl;
+    string small(3000, 'c');
+    ChunkStore::FileWriter first(store);
+    assert(first.write(small.data(), small.size()) && first.finish() && first.commit("first.mp3", "4"));
+    vector<string> firstPaths;
+    assert(store.find("first.mp3", chunks, firstPaths) && firstPaths.size() == 1);
+    // Swapping the stored bytes leaves the store holding a chunk whose hash is that of small, but isn't small
+    string colliding(small.size(), 'd');
+    std::ofstream(firstPaths[0], std::ios::binary) << colliding;
+    ChunkStore::FileWriter collider(store);
+    assert(collider.write(small.data(), small.size()) && collider.finish() && collider.commit("collider.mp3", "5"));
+    vector<Chunk> colliderChunks;
+    vector<string> colliderPaths;
+    assert(store.find("collider.mp3", colliderChunks, colliderPaths) && colliderPaths.size() == 1);
+    assert(colliderChunks[0].hash == chunks[0].hash && colliderPaths[0] != firstPaths[0]);
+    {
+        ChunkStore reopened(directory);
+        assert(reopened.find("first.mp3", chunks, firstPaths));
+        assert(reopened.find("collider.mp3", chunks, colliderPaths));
+        std::ifstream firstChunk(firstPaths[0], std::ios::binary);
+        assert(string(std::istreambuf_iterator<char>(firstChunk), std::istreambuf_iterator<char>()) == colliding);
+        std::ifstream colliderChunk(colliderPaths[0], std::ios::binary);
+        assert(string(std::istreambuf_iterator<char>(colliderChunk), std::istreambuf_iterator<char>()) == small);
+    }
+
+    cout << "  Check that an exported file is written out whole and leaves the store" << endl;
+    CRC32State crc;
+    crc.update(retagged.data(), retagged.size());
+    ChunkStore::FileWriter writer(store);
+    assert(writer.write(retagged.data(), retagged.size()) && writer.finish());
+    assert(writer.commit("export.mp3", crc.toString()));
+    assert(store.exportFile("export.mp3", directory + "export.mp3"));
+    std::ifstream exported(directory + "export.mp3", std::ios::binary);
+    assert(string(std::istreambuf_iterator<char>(exported), std::istreambuf_iterator<char>()) == retagged);
+    assert(!store.exportFile("export.mp3", directory + "again.mp3"));
+    // retagged.mp3 was stored under a made-up checksum, which its chunks don't match
+    assert(!store.exportFile("retagged.mp3", directory + "retagged.mp3"));
+    assert(store.filenames() == (set<string>{"collider.mp3", "first.mp3", "original.mp3", "retagged.mp3"}));
+
+    cout << "  Check that exporting never replaces a file already there" << endl;
+    ChunkStore::FileWriter second(store);
+    assert(second.write(retagged.data(), retagged.size()) && second.finish());
+    assert(second.commit("second.mp3", crc.toString()));
+    std::ofstream(directory + "second.mp3") << "already here";
+    assert(!store.exportFile("second.mp3", directory + "second.mp3"));
+    std::ifstream existing(directory + "second.mp3");
+    assert(string(std::istreambuf_iterator<char>(existing), std::istreambuf_iterator<char>()) == "already here");
+    assert(store.filenames().count("second.mp3") == 1);
+
+    assert(system(("rm -rf " + directory).c_str()) == 0);
+}
+
+void testReceivedFiles() {
+    cout << "Testing moving received files into place" << endl;
+    char directoryTemplate[] = "testServerDir/.gmmReceiveTest.XXXXXX";
+    string directory = string(mkdtemp(directoryTemplate)) + "/";
+    std::ofstream(directory + "song.mp3") << "original";
+
+    cout << "  Check that a file not yet listed is never replaced" << endl;
+    set<string> filenames;
+    string tempPath = createTempFile(directory);
+    std::ofstream(tempPath) << "pushed";
+    string placed = moveIntoPlace(tempPath, directory, "song.mp3", filenames);
+    assert(placed == "song (1).mp3");
+    std::ifstream original(directory + "song.mp3");
+    assert(string(std::istreambuf_iterator<char>(original), std::istreambuf_iterator<char>()) == "original");
+    std::ifstream pushed(directory + placed);
+    assert(string(std::istreambuf_iterator<char>(pushed), std::istreambuf_iterator<char>()) == "pushed");
+    assert(access(tempPath.c_str(), F_OK) != 0);
+
+    cout << "  Check that pushes named after internal files or outside the directory are refused" << endl;
+    std::ofstream(directory + CHECKSUM_INDEX_FILENAME) << "index";
+    for (const string &name : {string(CHECKSUM_INDEX_FILENAME), string("../x"), string(".."), string("")}) {
+        assert(!isListedFilename(name));
+        tempPath = createTempFile(directory);
+        std::ofstream(tempPath) << "pushed";
+        assert(moveIntoPlace(tempPath, directory, name, filenames).empty());
+        assert(access(tempPath.c_str(), F_OK) != 0);
+    }
+    std::ifstream index(directory + CHECKSUM_INDEX_FILENAME);
+    assert(string(std::istreambuf_iterator<char>(index), std::istreambuf_iterator<char>()) == "index");
+    assert(access((directory + "../x").c_str(), F_OK) != 0);
+    {
+        ChunkStore store(directory);
+        ChunkStore::FileWriter writer(store);
+        assert(writer.write("pushed", 6) && writer.finish());
+        assert(!writer.commit("../x", "1") && !writer.commit(CHECKSUM_INDEX_FILENAME, "1"));
+    }
+
+    assert(system(("rm -rf " + directory).c_str()) == 0);
 }
 
 int main() {
     prettyPrintTester();
     testFilenameIncrement();
+    testJSONCopies();
+    testJSONArena();
+    testBinaryMessages();
+    testChunking();
+    testFileDelta();
+    testCompression();
+    testListing();
+    testChangeJournal();
+    testDirectoryWatcher();
+    testChunkStore();
+    testReceivedFiles();
 
     return 0;
 }